@@ -0,0 +1,1140 @@
+#include <memory>
+#include <thread>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+
+#include <boost/asio.hpp>
+
+#include "SoraFastCGI.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace asio = boost::asio;
+using boost::system::error_code;
+
+// Benchmarks for the server. Each mode is selected by the first argument and
+// configured with --name=value options:
+//
+// The server is reached over TCP at --host/--port (default 127.0.0.1:6666),
+// or over a Unix domain socket when --unix=<path> is given.
+//
+//   memory   --pid=<server pid> [--connections=1000]
+//            Opens keep-alive connections, completes one request on each and
+//            reports the server's resident and virtual memory growth per
+//            connection. Compare --coroutines=stackful and stackless runs.
+//
+//   latency  [--requests=20000] [--tcp=0|1] [--unix=<path>]
+//            Sends sequential requests over one keep-alive connection on each
+//            available transport and compares round-trip latency.
+//
+//   params   [--iterations=1000000]
+//            Decodes a typical nginx FCGI_PARAMS block with ReadKeyValuePair
+//            into an unordered_map and with ParamStore, and compares the cost.
+//
+//   form     [--iterations=1000000] [--upload=4194304]
+//            Parses the calculator's "a=3&b=4" body the way it used to (cut
+//            at the first line, then sscanf) and with FormParser, then a
+//            large urlencoded form and a multipart upload with a plain byte
+//            loop and with FormParser, in STDIN-record-sized chunks. Build
+//            with -mavx2 or -DSORA_FCGI_NO_SIMD to compare the scan paths.
+//
+//   log      [--threads=4] [--messages=200000]
+//            Floods the old stringstream logger and the ring buffer logger
+//            from several threads and compares the cost per message seen by
+//            the logging threads. Run with stderr sent to /dev/null.
+//
+//   load     [--connections=16] [--threads=2] [--duration=5] [--keepalive=1]
+//            [--inflight=1] [--interleave=0] [--params=20] [--stdin=0]
+//            Closed-loop load generator speaking FastCGI like nginx. Every
+//            connection sends `inflight` requests at once (multiplexed ids;
+//            interleaved record by record with --interleave=1, pipelined
+//            back to back otherwise), waits for all of them and repeats.
+//            --keepalive=0 opens a connection per request. Reports
+//            throughput and p50/p99/p999 latency.
+//
+//   micro    [--filter=<substring>] [--min-time=0.2]
+//            Microbenchmarks of record encode/decode, params parsing and
+//            routing, printed in the style of Google Benchmark.
+//
+//   startup  --server=<path> [--runs=20] [--workers=2] [--args="..."]
+//            Starts the server binary listening on --port or --unix (plus
+//            the space-separated --args), times how long until it answers
+//            its first request, then how long it takes to exit on SIGTERM.
+//            Runs it as a single process and with --workers under the
+//            supervisor, where the supervisor's socket takes connections
+//            before any worker is up.
+//
+// Modes that exercise server code in-process need FastCGIUtils.cpp,
+// FastCGIParams.cpp, FastCGIRecordPool.cpp, FastCGILog.cpp,
+// FastCGIForm.cpp and FastCGIRouter.cpp linked in, as in (on one line)
+//
+//   g++ -std=c++17 -O2 FastCGIBench.cpp FastCGIUtils.cpp FastCGIParams.cpp
+//       FastCGIRecordPool.cpp FastCGILog.cpp FastCGIForm.cpp
+//       FastCGIRouter.cpp -o bench -lboost_system -lpthread
+
+namespace SoraFastCGI
+{
+    namespace Bench
+    {
+        class Options
+        {
+            std::map<std::string, std::string> values_;
+
+        public:
+            Options(int argc, char** argv)
+            {
+                for (int i = 2; i < argc; ++i)
+                {
+                    std::string arg = argv[i];
+                    if (arg.compare(0, 2, "--") != 0)
+                        continue;
+                    std::string::size_type eq = arg.find('=');
+                    if (eq == std::string::npos)
+                        values_[arg.substr(2)] = "1";
+                    else
+                        values_[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+                }
+            }
+
+            std::string Get(const std::string& name, const std::string& def) const
+            {
+                auto it = values_.find(name);
+                return it == values_.end() ? def : it->second;
+            }
+
+            long long GetInt(const std::string& name, long long def) const
+            {
+                auto it = values_.find(name);
+                return it == values_.end() ? def : atoll(it->second.c_str());
+            }
+        };
+
+        void AppendRecord(std::string& out, unsigned char type, unsigned short reqId, const char* data, unsigned short len)
+        {
+            SoraFCGIHeader header{};
+            header.version = FCGI_VERSION_1;
+            header.type = type;
+            header.RequestId(reqId);
+            header.ContentLength(len);
+            out.append((const char*)&header, FCGI_HEADER_LEN);
+            out.append(data, len);
+        }
+
+        void AppendLength(std::string& out, unsigned int len)
+        {
+            if (len < 0x80)
+            {
+                out.push_back((char)len);
+            }
+            else
+            {
+                out.push_back((char)((len >> 24) | 0x80));
+                out.push_back((char)((len >> 16) & 0xff));
+                out.push_back((char)((len >> 8) & 0xff));
+                out.push_back((char)(len & 0xff));
+            }
+        }
+
+        using ParamList = std::vector<std::pair<std::string, std::string>>;
+
+        std::string EncodeParams(const ParamList& params)
+        {
+            std::string out;
+            for (auto& p : params)
+            {
+                AppendLength(out, (unsigned int)p.first.size());
+                AppendLength(out, (unsigned int)p.second.size());
+                out += p.first;
+                out += p.second;
+            }
+            return out;
+        }
+
+        // Encodes a complete responder request the way nginx sends it.
+        std::string EncodeRequest(unsigned short reqId, const ParamList& params, const std::string& body, bool keepConn)
+        {
+            std::string out;
+
+            FCGI_BeginRequestBody begin{};
+            begin.roleB0 = FCGI_RESPONDER;
+            begin.flags = keepConn ? FCGI_KEEP_CONN : 0;
+            AppendRecord(out, FCGI_BEGIN_REQUEST, reqId, (const char*)&begin, sizeof(begin));
+
+            std::string encoded = EncodeParams(params);
+            for (std::size_t pos = 0; pos < encoded.size(); pos += ushort_max)
+                AppendRecord(out, FCGI_PARAMS, reqId, encoded.data() + pos, (unsigned short)std::min<std::size_t>(ushort_max, encoded.size() - pos));
+            AppendRecord(out, FCGI_PARAMS, reqId, "", 0);
+
+            for (std::size_t pos = 0; pos < body.size(); pos += ushort_max)
+                AppendRecord(out, FCGI_STDIN, reqId, body.data() + pos, (unsigned short)std::min<std::size_t>(ushort_max, body.size() - pos));
+            AppendRecord(out, FCGI_STDIN, reqId, "", 0);
+
+            return out;
+        }
+
+        ParamList DefaultParams(const std::string& method, std::size_t contentLength)
+        {
+            return {
+                { "QUERY_STRING", "" },
+                { "REQUEST_METHOD", method },
+                { "CONTENT_TYPE", "application/x-www-form-urlencoded" },
+                { "CONTENT_LENGTH", std::to_string(contentLength) },
+                { "SCRIPT_NAME", "/index.fcgi" },
+                { "REQUEST_URI", "/index.fcgi" },
+                { "DOCUMENT_URI", "/index.fcgi" },
+                { "DOCUMENT_ROOT", "/var/www/html" },
+                { "SERVER_PROTOCOL", "HTTP/1.1" },
+                { "REQUEST_SCHEME", "http" },
+                { "GATEWAY_INTERFACE", "CGI/1.1" },
+                { "SERVER_SOFTWARE", "nginx/1.24.0" },
+                { "REMOTE_ADDR", "127.0.0.1" },
+                { "REMOTE_PORT", "51234" },
+                { "SERVER_ADDR", "127.0.0.1" },
+                { "SERVER_PORT", "80" },
+                { "SERVER_NAME", "localhost" },
+                { "HTTP_HOST", "localhost" },
+                { "HTTP_USER_AGENT", "SoraFastCGI-bench" },
+                { "HTTP_ACCEPT", "*/*" },
+            };
+        }
+
+        // Reads records until END_REQUEST for `reqId`; returns the STDOUT bytes seen.
+        template<class Socket>
+        std::size_t ReadResponse(Socket& socket, unsigned short reqId, std::string& pending)
+        {
+            std::size_t stdoutBytes = 0;
+            char chunk[64 * 1024];
+            for (;;)
+            {
+                while (pending.size() >= FCGI_HEADER_LEN)
+                {
+                    SoraFCGIHeader header;
+                    memcpy(&header, pending.data(), FCGI_HEADER_LEN);
+                    if (pending.size() < header.TotalLength())
+                        break;
+                    unsigned int total = header.TotalLength();
+                    bool done = header.type == FCGI_END_REQUEST && header.RequestId() == reqId;
+                    if (header.type == FCGI_STDOUT)
+                        stdoutBytes += header.ContentLength();
+                    pending.erase(0, total);
+                    if (done)
+                        return stdoutBytes;
+                }
+                std::size_t n = socket.read_some(asio::buffer(chunk));
+                pending.append(chunk, n);
+            }
+        }
+
+        using StreamSocket = asio::generic::stream_protocol::socket;
+
+        asio::generic::stream_protocol::endpoint TcpEndpoint(const Options& options)
+        {
+            return asio::ip::tcp::endpoint(asio::ip::address::from_string(options.Get("host", "127.0.0.1")), (unsigned short)options.GetInt("port", 6666));
+        }
+
+        asio::generic::stream_protocol::endpoint UnixEndpoint(const Options& options)
+        {
+            return asio::local::stream_protocol::endpoint(options.Get("unix", ""));
+        }
+
+        // The endpoint the server was told to listen on: Unix if --unix is given.
+        asio::generic::stream_protocol::endpoint ServerEndpoint(const Options& options)
+        {
+            return options.Get("unix", "").empty() ? TcpEndpoint(options) : UnixEndpoint(options);
+        }
+
+        std::unique_ptr<StreamSocket> Connect(asio::io_service& io_service, const asio::generic::stream_protocol::endpoint& endpoint)
+        {
+            std::unique_ptr<StreamSocket> socket(new StreamSocket(io_service));
+            socket->connect(endpoint);
+            if (endpoint.protocol().family() != AF_UNIX)
+                socket->set_option(asio::ip::tcp::no_delay(true));
+            return socket;
+        }
+
+        double Percentile(std::vector<double>& sorted, double p)
+        {
+            if (sorted.empty())
+                return 0;
+            std::size_t i = (std::size_t)(p * (sorted.size() - 1) + 0.5);
+            return sorted[i];
+        }
+
+        // Reads a size field such as "VmRSS:" from /proc/<pid>/status.
+        long long StatusBytes(long long pid, const std::string& field)
+        {
+            std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+            std::string line;
+            while (std::getline(status, line))
+            {
+                if (line.compare(0, field.size(), field) == 0)
+                    return atoll(line.c_str() + field.size()) * 1024;
+            }
+            return -1;
+        }
+
+        long long ResidentBytes(long long pid)
+        {
+            return StatusBytes(pid, "VmRSS:");
+        }
+
+        int RunMemory(const Options& options)
+        {
+            long long pid = options.GetInt("pid", 0);
+            if (pid <= 0)
+            {
+                std::cerr << "memory: --pid=<server pid> is required" << std::endl;
+                return 1;
+            }
+            int connections = (int)options.GetInt("connections", 1000);
+
+            asio::io_service io_service;
+            auto endpoint = ServerEndpoint(options);
+
+            std::string request = EncodeRequest(1, DefaultParams("GET", 0), "", true);
+
+            long long before = ResidentBytes(pid);
+            long long virtualBefore = StatusBytes(pid, "VmSize:");
+            std::vector<std::unique_ptr<StreamSocket>> sockets;
+            for (int i = 0; i < connections; ++i)
+            {
+                std::unique_ptr<StreamSocket> socket = Connect(io_service, endpoint);
+                asio::write(*socket, asio::buffer(request));
+                std::string pending;
+                ReadResponse(*socket, 1, pending);
+                sockets.push_back(std::move(socket));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            long long after = ResidentBytes(pid);
+            long long virtualAfter = StatusBytes(pid, "VmSize:");
+
+            printf("connections: %d\n", connections);
+            printf("server rss before: %lld KiB\n", before / 1024);
+            printf("server rss after: %lld KiB\n", after / 1024);
+            printf("rss per connection: %.1f KiB\n", (after - before) / 1024.0 / connections);
+            printf("virtual per connection: %.1f KiB\n", (virtualAfter - virtualBefore) / 1024.0 / connections);
+            return 0;
+        }
+
+        void MeasureLatency(const char* name, const asio::generic::stream_protocol::endpoint& endpoint, int requests)
+        {
+            asio::io_service io_service;
+            std::unique_ptr<StreamSocket> socket = Connect(io_service, endpoint);
+            std::string request = EncodeRequest(1, DefaultParams("GET", 0), "", true);
+            std::string pending;
+
+            // Warm up the connection and the server's pools first.
+            for (int i = 0; i < 100; ++i)
+            {
+                asio::write(*socket, asio::buffer(request));
+                ReadResponse(*socket, 1, pending);
+            }
+
+            std::vector<double> samples;
+            samples.reserve(requests);
+            for (int i = 0; i < requests; ++i)
+            {
+                auto begin = std::chrono::steady_clock::now();
+                asio::write(*socket, asio::buffer(request));
+                ReadResponse(*socket, 1, pending);
+                samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+            }
+
+            std::sort(samples.begin(), samples.end());
+            double total = 0;
+            for (double x : samples)
+                total += x;
+            printf("%-5s requests=%d mean=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus\n", name, requests,
+                total / samples.size(), Percentile(samples, 0.5), Percentile(samples, 0.99), Percentile(samples, 0.999));
+        }
+
+        int RunLatency(const Options& options)
+        {
+            int requests = (int)options.GetInt("requests", 20000);
+            if (options.GetInt("tcp", 1))
+                MeasureLatency("tcp", TcpEndpoint(options), requests);
+            if (!options.Get("unix", "").empty())
+                MeasureLatency("unix", UnixEndpoint(options), requests);
+            return 0;
+        }
+
+        template<class F>
+        double NanosecondsPerIteration(long long iterations, F&& f)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            for (long long i = 0; i < iterations; ++i)
+                f();
+            auto end = std::chrono::steady_clock::now();
+            return std::chrono::duration<double, std::nano>(end - begin).count() / iterations;
+        }
+
+        int RunParams(const Options& options)
+        {
+            long long iterations = options.GetInt("iterations", 1000000);
+            std::string encoded = EncodeParams(DefaultParams("POST", 7));
+            const char* beginPtr = encoded.data();
+            const char* endPtr = beginPtr + encoded.size();
+            std::size_t sink = 0;
+
+            double mapNs = NanosecondsPerIteration(iterations, [&]() {
+                std::unordered_map<std::string, std::string> params;
+                const char* p = beginPtr;
+                while (p < endPtr)
+                {
+                    std::string key, value;
+                    p = ReadKeyValuePair(p, key, value);
+                    params[key] = value;
+                }
+                sink += params["REQUEST_METHOD"].size() + params["SCRIPT_NAME"].size();
+            });
+
+            ParamStore store;
+            double storeNs = NanosecondsPerIteration(iterations, [&]() {
+                store.Clear();
+                store.Append(beginPtr, (unsigned int)encoded.size());
+                sink += store.Get(ParamRequestMethod).size() + store.Get(ParamScriptName).size();
+            });
+
+            printf("params: %zu pairs, %zu bytes\n", DefaultParams("POST", 7).size(), encoded.size());
+            printf("ReadKeyValuePair + unordered_map: %.1f ns/request\n", mapNs);
+            printf("ParamStore: %.1f ns/request\n", storeNs);
+            printf("(checksum %zu)\n", sink);
+            return 0;
+        }
+
+        // Counts what a FormParser passes on, so only the parsing is measured.
+        struct CountingFields : IFormFieldConsumer
+        {
+            std::size_t fields = 0;
+            std::size_t bytes = 0;
+
+            void OnFieldBegin(std::string_view name, std::string_view filename) override { ++fields; }
+            void OnFieldData(const char* data, std::size_t len) override { bytes += len; }
+            void OnFieldEnd() override {}
+        };
+
+        // Feeds `body` to a fresh parser in chunks of at most one STDIN record.
+        template<class Fields>
+        void ParseForm(const char* contentType, const std::string& body, Fields& fields)
+        {
+            FormParser parser(contentType, fields);
+            for (std::size_t pos = 0; pos < body.size(); pos += ushort_max)
+                parser.OnBodyData(body.data() + pos, std::min<std::size_t>(ushort_max, body.size() - pos));
+            parser.OnBodyEnd();
+        }
+
+        int RunForm(const Options& options)
+        {
+            long long iterations = options.GetInt("iterations", 1000000);
+            std::size_t upload = (std::size_t)options.GetInt("upload", 4 * 1024 * 1024);
+            std::size_t sink = 0;
+
+#if defined(__AVX2__) && !defined(SORA_FCGI_NO_SIMD)
+            const char* scan = "avx2";
+#elif defined(__SSE2__) && !defined(SORA_FCGI_NO_SIMD)
+            const char* scan = "sse2";
+#else
+            const char* scan = "scalar";
+#endif
+            printf("delimiter scan: %s\n", scan);
+
+            std::string small = "a=3&b=4";
+            double lineNs = NanosecondsPerIteration(iterations, [&]() {
+                const char* newline = (const char*)memchr(small.data(), '\n', small.size());
+                std::string line(small.data(), newline ? newline - small.data() : small.size());
+                int a, b;
+                if (sscanf(line.c_str(), "a=%d&b=%d", &a, &b) == 2)
+                    sink += a + b;
+            });
+            double smallNs = NanosecondsPerIteration(iterations, [&]() {
+                FormFields fields(4096);
+                ParseForm("application/x-www-form-urlencoded", small, fields);
+                sink += fields.Get("a").size() + fields.Get("b").size();
+            });
+            printf("small form, first line + sscanf: %.1f ns/request\n", lineNs);
+            printf("small form, FormParser + FormFields: %.1f ns/request\n", smallNs);
+
+            // Text fields as a browser encodes them: mostly plain, with '+'
+            // for spaces and the odd escape.
+            std::string urlencoded;
+            for (int i = 0; urlencoded.size() < upload; ++i)
+            {
+                urlencoded += "field" + std::to_string(i) + "=";
+                for (int j = 0; j < 40; ++j)
+                    urlencoded += "Lorem+ipsum+dolor+sit+amet%2C+consectetur+adipiscing+elit";
+                urlencoded += "&";
+            }
+
+            long long passes = std::max<long long>(1, iterations / 10000);
+            double loopNs = NanosecondsPerIteration(passes, [&]() {
+                std::string name, value;
+                bool inValue = false;
+                for (std::size_t i = 0; i < urlencoded.size(); ++i)
+                {
+                    char c = urlencoded[i];
+                    std::string& out = inValue ? value : name;
+                    if (c == '&')
+                    {
+                        sink += value.size();
+                        name.clear();
+                        value.clear();
+                        inValue = false;
+                    }
+                    else if (c == '=' && !inValue)
+                        inValue = true;
+                    else if (c == '+')
+                        out += ' ';
+                    else if (c == '%' && i + 2 < urlencoded.size())
+                    {
+                        out += (char)strtol(urlencoded.substr(i + 1, 2).c_str(), nullptr, 16);
+                        i += 2;
+                    }
+                    else
+                        out += c;
+                }
+            });
+            double urlNs = NanosecondsPerIteration(passes, [&]() {
+                CountingFields fields;
+                ParseForm("application/x-www-form-urlencoded", urlencoded, fields);
+                sink += fields.bytes;
+            });
+            printf("urlencoded %zu bytes, byte loop: %.0f MB/s\n", urlencoded.size(), urlencoded.size() * 1e3 / loopNs);
+            printf("urlencoded %zu bytes, FormParser: %.0f MB/s\n", urlencoded.size(), urlencoded.size() * 1e3 / urlNs);
+
+            // One file part of pseudo-random bytes, so CRs and dashes turn
+            // up now and then as they do in binary uploads.
+            std::string boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+            std::string multipart = "--" + boundary + "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"upload.bin\"\r\n"
+                "Content-Type: application/octet-stream\r\n\r\n";
+            unsigned int seed = 1;
+            for (std::size_t i = 0; i < upload; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                multipart += (char)(seed >> 16);
+            }
+            multipart += "\r\n--" + boundary + "--\r\n";
+            std::string contentType = "multipart/form-data; boundary=" + boundary;
+            std::string delimiter = "\r\n--" + boundary;
+
+            double findNs = NanosecondsPerIteration(passes, [&]() {
+                std::string_view body(multipart);
+                std::size_t start = body.find("\r\n\r\n") + 4;
+                sink += body.find(delimiter, start) - start;
+            });
+            double multipartNs = NanosecondsPerIteration(passes, [&]() {
+                CountingFields fields;
+                ParseForm(contentType.c_str(), multipart, fields);
+                sink += fields.bytes;
+            });
+            printf("multipart %zu bytes, string_view::find: %.0f MB/s\n", multipart.size(), multipart.size() * 1e3 / findNs);
+            printf("multipart %zu bytes, FormParser: %.0f MB/s\n", multipart.size(), multipart.size() * 1e3 / multipartNs);
+
+            printf("(checksum %zu)\n", sink);
+            return 0;
+        }
+
+        // Wall time for `threads` threads to each run `f(thread, i)` `count` times.
+        template<class F>
+        double NanosecondsPerMessage(int threads, long long count, F f)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            std::vector<std::thread> pool;
+            for (int t = 0; t < threads; ++t)
+            {
+                pool.emplace_back([&f, t, count]() {
+                    for (long long i = 0; i < count; ++i)
+                        f(t, i);
+                });
+            }
+            for (auto& thread : pool)
+                thread.join();
+            auto end = std::chrono::steady_clock::now();
+            return std::chrono::duration<double, std::nano>(end - begin).count() / (count * threads);
+        }
+
+        int RunLog(const Options& options)
+        {
+            int threads = (int)options.GetInt("threads", 4);
+            long long messages = options.GetInt("messages", 200000);
+
+            // The logger this replaced: a stringstream per message, posted as
+            // a string copy to one io_service drained by a single thread.
+            asio::io_service legacyService;
+            std::thread legacyThread;
+            {
+                asio::io_service::work work(legacyService);
+                legacyThread = std::thread([&]() { legacyService.run(); });
+
+                double legacyNs = NanosecondsPerMessage(threads, messages, [&](int t, long long i) {
+                    std::stringstream ss;
+                    ss << "ReqId:" << t << " Unsupported type " << (int)(i & 0xff) << std::endl;
+                    std::string msg = ss.str();
+                    legacyService.post([msg]() {
+                        std::cerr << msg;
+                    });
+                });
+                printf("stringstream + io_service::post: %.1f ns/message\n", legacyNs);
+            }
+            legacyThread.join();
+
+            StartLogger();
+            double ringNs = NanosecondsPerMessage(threads, messages, [&](int t, long long i) {
+                LogOutput(LogWarning) << "ReqId:" << t << " Unsupported type " << (int)(i & 0xff);
+            });
+            StopLogger();
+
+            LogStats stats = GetLogStats();
+            printf("per-thread rings: %.1f ns/message, %llu written, %llu dropped\n", ringNs, stats.written, stats.dropped);
+            return 0;
+        }
+
+        // Splits an encoded request stream into its records.
+        std::vector<std::string> SplitRecords(const std::string& stream)
+        {
+            std::vector<std::string> records;
+            for (std::size_t pos = 0; pos < stream.size();)
+            {
+                SoraFCGIHeader header;
+                memcpy(&header, stream.data() + pos, FCGI_HEADER_LEN);
+                records.push_back(stream.substr(pos, header.TotalLength()));
+                pos += header.TotalLength();
+            }
+            return records;
+        }
+
+        // One round's worth of requests with ids 1..inflight. Interleaved,
+        // their records alternate the way a multiplexing client sends them;
+        // otherwise each request is sent whole, one after another.
+        std::string EncodeRound(int inflight, bool interleave, const ParamList& params, const std::string& body, bool keepConn)
+        {
+            std::vector<std::vector<std::string>> requests;
+            for (int i = 1; i <= inflight; ++i)
+                requests.push_back(SplitRecords(EncodeRequest((unsigned short)i, params, body, keepConn)));
+
+            std::string out;
+            if (!interleave)
+            {
+                for (auto& request : requests)
+                    for (auto& record : request)
+                        out += record;
+                return out;
+            }
+
+            for (std::size_t r = 0; r < requests[0].size(); ++r)
+                for (auto& request : requests)
+                    out += request[r];
+            return out;
+        }
+
+        struct LoadStats
+        {
+            std::vector<double> latencies;
+            unsigned long long requests = 0;
+            unsigned long long failures = 0;
+            unsigned long long stdoutBytes = 0;
+        };
+
+        // A closed-loop client: sends a round of requests, waits for every
+        // END_REQUEST, and starts the next round until the deadline.
+        class LoadConnection : public std::enable_shared_from_this<LoadConnection>
+        {
+            asio::io_service& io_service_;
+            asio::generic::stream_protocol::endpoint endpoint_;
+            const std::string& round_;
+            int inflight_;
+            bool keepAlive_;
+            std::chrono::steady_clock::time_point deadline_;
+            LoadStats& stats_;
+
+            StreamSocket socket_;
+            std::chrono::steady_clock::time_point roundStart_;
+            int remaining_;
+            std::string pending_;
+            char chunk_[64 * 1024];
+
+            void Fail()
+            {
+                ++stats_.failures;
+                error_code ignored;
+                socket_.close(ignored);
+                if (std::chrono::steady_clock::now() < deadline_)
+                    Connect();
+            }
+
+            void Connect()
+            {
+                pending_.clear();
+                auto self = shared_from_this();
+                socket_.async_connect(endpoint_, [self](const error_code& ec) {
+                    if (ec)
+                        return self->Fail();
+                    if (self->endpoint_.protocol().family() != AF_UNIX)
+                    {
+                        error_code ignored;
+                        self->socket_.set_option(asio::ip::tcp::no_delay(true), ignored);
+                    }
+                    self->Send();
+                });
+            }
+
+            void Send()
+            {
+                roundStart_ = std::chrono::steady_clock::now();
+                if (roundStart_ >= deadline_)
+                {
+                    error_code ignored;
+                    socket_.close(ignored);
+                    return;
+                }
+
+                remaining_ = inflight_;
+                auto self = shared_from_this();
+                asio::async_write(socket_, asio::buffer(round_), [self](const error_code& ec, std::size_t) {
+                    if (ec)
+                        return self->Fail();
+                    self->Read();
+                });
+            }
+
+            void Read()
+            {
+                auto self = shared_from_this();
+                socket_.async_read_some(asio::buffer(chunk_), [self](const error_code& ec, std::size_t n) {
+                    if (ec)
+                        return self->Fail();
+                    self->pending_.append(self->chunk_, n);
+                    self->OnData();
+                });
+            }
+
+            void OnData()
+            {
+                std::size_t pos = 0;
+                while (pending_.size() - pos >= FCGI_HEADER_LEN)
+                {
+                    SoraFCGIHeader header;
+                    memcpy(&header, pending_.data() + pos, FCGI_HEADER_LEN);
+                    if (pending_.size() - pos < header.TotalLength())
+                        break;
+
+                    if (header.type == FCGI_STDOUT)
+                    {
+                        stats_.stdoutBytes += header.ContentLength();
+                    }
+                    else if (header.type == FCGI_END_REQUEST)
+                    {
+                        const FCGI_EndRequestBody* body = (const FCGI_EndRequestBody*)(pending_.data() + pos + FCGI_HEADER_LEN);
+                        if (body->protocolStatus == FCGI_REQUEST_COMPLETE)
+                        {
+                            ++stats_.requests;
+                            stats_.latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - roundStart_).count());
+                        }
+                        else
+                        {
+                            ++stats_.failures;
+                        }
+                        --remaining_;
+                    }
+                    pos += header.TotalLength();
+                }
+                pending_.erase(0, pos);
+
+                if (remaining_ > 0)
+                    return Read();
+
+                if (keepAlive_)
+                    return Send();
+
+                error_code ignored;
+                socket_.close(ignored);
+                if (std::chrono::steady_clock::now() < deadline_)
+                    Connect();
+            }
+
+        public:
+            LoadConnection(asio::io_service& io_service, const asio::generic::stream_protocol::endpoint& endpoint, const std::string& round,
+                int inflight, bool keepAlive, std::chrono::steady_clock::time_point deadline, LoadStats& stats)
+                : io_service_(io_service)
+                , endpoint_(endpoint)
+                , round_(round)
+                , inflight_(inflight)
+                , keepAlive_(keepAlive)
+                , deadline_(deadline)
+                , stats_(stats)
+                , socket_(io_service)
+                , remaining_{}
+            {
+            }
+
+            void Start()
+            {
+                Connect();
+            }
+        };
+
+        int RunLoad(const Options& options)
+        {
+            int connections = (int)options.GetInt("connections", 16);
+            int threads = std::max(1, (int)options.GetInt("threads", 2));
+            double duration = std::max(0.1, atof(options.Get("duration", "5").c_str()));
+            bool keepAlive = options.GetInt("keepalive", 1) != 0;
+            int inflight = keepAlive ? std::max(1, std::min(ushort_max - 1, (int)options.GetInt("inflight", 1))) : 1;
+            bool interleave = options.GetInt("interleave", 0) != 0;
+            int paramCount = (int)options.GetInt("params", 20);
+            std::size_t stdinBytes = (std::size_t)options.GetInt("stdin", 0);
+            auto endpoint = ServerEndpoint(options);
+
+            ParamList params = DefaultParams(stdinBytes > 0 ? "POST" : "GET", stdinBytes);
+            if ((int)params.size() > paramCount)
+                params.resize(std::max(paramCount, 4));
+            for (int i = (int)params.size(); i < paramCount; ++i)
+                params.emplace_back("HTTP_X_BENCH_" + std::to_string(i), std::string(24, 'v'));
+
+            std::string body;
+            if (stdinBytes > 0)
+            {
+                body = "a=1&b=2\n";
+                body.resize(std::max(stdinBytes, body.size()), 'x');
+            }
+            std::string round = EncodeRound(inflight, interleave, params, body, keepAlive);
+
+            auto begin = std::chrono::steady_clock::now();
+            auto deadline = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(duration));
+
+            std::vector<LoadStats> stats(threads);
+            std::vector<std::thread> pool;
+            for (int t = 0; t < threads; ++t)
+            {
+                pool.emplace_back([&, t]() {
+                    asio::io_service io_service;
+                    for (int c = t; c < connections; c += threads)
+                        std::make_shared<LoadConnection>(io_service, endpoint, round, inflight, keepAlive, deadline, stats[t])->Start();
+                    io_service.run();
+                });
+            }
+            for (auto& thread : pool)
+                thread.join();
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+            LoadStats total;
+            for (auto& s : stats)
+            {
+                total.latencies.insert(total.latencies.end(), s.latencies.begin(), s.latencies.end());
+                total.requests += s.requests;
+                total.failures += s.failures;
+                total.stdoutBytes += s.stdoutBytes;
+            }
+            std::sort(total.latencies.begin(), total.latencies.end());
+
+            printf("connections=%d threads=%d inflight=%d interleave=%d keepalive=%d params=%zu stdin=%zu\n",
+                connections, threads, inflight, (int)interleave, (int)keepAlive, params.size(), body.size());
+            printf("requests=%llu failures=%llu elapsed=%.2fs throughput=%.0f req/s stdout=%.1f MiB/s\n",
+                total.requests, total.failures, elapsed, total.requests / elapsed, total.stdoutBytes / elapsed / (1024 * 1024));
+            printf("latency p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+                Percentile(total.latencies, 0.5), Percentile(total.latencies, 0.99), Percentile(total.latencies, 0.999),
+                total.latencies.empty() ? 0.0 : total.latencies.back());
+            return total.requests > 0 ? 0 : 1;
+        }
+
+        // Starts `args` and returns the milliseconds until it answered a
+        // request, or -1 if it exited or did not answer within ten seconds.
+        // Stops it again
+        // and stores how long it took to exit in `stopMs`.
+        double MeasureStartup(std::vector<std::string> args, const asio::generic::stream_protocol::endpoint& endpoint, double& stopMs)
+        {
+            std::vector<char*> argv;
+            for (std::string& arg : args)
+                argv.push_back(&arg[0]);
+            argv.push_back(nullptr);
+            std::string request = EncodeRequest(1, DefaultParams("GET", 0), "", false);
+
+            auto begin = std::chrono::steady_clock::now();
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                int null = open("/dev/null", O_RDWR);
+                dup2(null, 0);
+                dup2(null, 2);
+                execv(argv[0], argv.data());
+                _exit(127);
+            }
+            if (pid < 0)
+                return -1;
+
+            double ms = -1;
+            int status;
+            asio::io_service io_service;
+            while (std::chrono::steady_clock::now() - begin < std::chrono::seconds(10))
+            {
+                if (waitpid(pid, &status, WNOHANG) == pid)
+                {
+                    stopMs = 0;
+                    return -1;
+                }
+
+                StreamSocket socket(io_service);
+                error_code ec;
+                socket.connect(endpoint, ec);
+                if (ec == boost::system::errc::success)
+                    asio::write(socket, asio::buffer(request), ec);
+                if (ec != boost::system::errc::success)
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    continue;
+                }
+
+                try
+                {
+                    std::string pending;
+                    ReadResponse(socket, 1, pending);
+                    ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+                    break;
+                }
+                catch (const boost::system::system_error&)
+                {
+                    // Closed on us while starting; try again.
+                }
+            }
+
+            auto stopBegin = std::chrono::steady_clock::now();
+            kill(pid, SIGTERM);
+            waitpid(pid, &status, 0);
+            stopMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stopBegin).count();
+            return ms;
+        }
+
+        int RunStartup(const Options& options)
+        {
+            std::string server = options.Get("server", "");
+            if (server.empty())
+            {
+                std::cerr << "startup: --server=<path to the server binary> is required" << std::endl;
+                return 1;
+            }
+            int runs = std::max(1, (int)options.GetInt("runs", 20));
+            long long workers = options.GetInt("workers", 2);
+            auto endpoint = ServerEndpoint(options);
+
+            std::vector<std::string> args = { server };
+            if (options.Get("unix", "").empty())
+                args.push_back("--port=" + std::to_string(options.GetInt("port", 6666)));
+            else
+                args.insert(args.end(), { "--transport=unix", "--unixPath=" + options.Get("unix", "") });
+            std::istringstream extra(options.Get("args", ""));
+            std::string arg;
+            while (extra >> arg)
+                args.push_back(arg);
+
+            {
+                asio::io_service io_service;
+                StreamSocket probe(io_service);
+                error_code ec;
+                probe.connect(endpoint, ec);
+                if (ec == boost::system::errc::success)
+                {
+                    std::cerr << "startup: something already listens on the server's address" << std::endl;
+                    return 1;
+                }
+            }
+
+            std::vector<std::pair<std::string, std::vector<std::string>>> modes = { { "single", args } };
+            if (workers > 0)
+            {
+                modes.emplace_back("workers=" + std::to_string(workers), args);
+                modes.back().second.push_back("--workers=" + std::to_string(workers));
+            }
+
+            int result = 0;
+            for (auto& mode : modes)
+            {
+                std::vector<double> started, stopped;
+                for (int i = 0; i < runs; ++i)
+                {
+                    double stopMs;
+                    double ms = MeasureStartup(mode.second, endpoint, stopMs);
+                    if (ms < 0)
+                    {
+                        std::cerr << "startup: " << mode.first << " did not answer" << std::endl;
+                        result = 1;
+                        break;
+                    }
+                    started.push_back(ms);
+                    stopped.push_back(stopMs);
+                }
+                std::sort(started.begin(), started.end());
+                std::sort(stopped.begin(), stopped.end());
+                printf("%-10s runs=%zu first response min=%.2fms p50=%.2fms max=%.2fms exit p50=%.2fms\n", mode.first.c_str(), started.size(),
+                    started.empty() ? 0.0 : started.front(), Percentile(started, 0.5), started.empty() ? 0.0 : started.back(), Percentile(stopped, 0.5));
+            }
+            return result;
+        }
+
+        // Runs `f` in growing batches until a batch takes at least `minTime`
+        // seconds, then reports the time per call like Google Benchmark does.
+        template<class F>
+        void Micro(const Options& options, const char* name, F&& f)
+        {
+            std::string filter = options.Get("filter", "");
+            if (!filter.empty() && std::string(name).find(filter) == std::string::npos)
+                return;
+
+            double minTime = atof(options.Get("min-time", "0.2").c_str());
+            long long iterations = 1;
+            for (;;)
+            {
+                auto begin = std::chrono::steady_clock::now();
+                for (long long i = 0; i < iterations; ++i)
+                    f();
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                if (seconds >= minTime || iterations >= (1LL << 40))
+                {
+                    printf("%-36s %12.1f ns %14lld\n", name, seconds * 1e9 / iterations, iterations);
+                    return;
+                }
+                iterations = seconds < minTime / 100 ? iterations * 10 : (long long)(iterations * minTime * 1.4 / seconds) + 1;
+            }
+        }
+
+        int RunMicro(const Options& options)
+        {
+            volatile std::size_t sink = 0;
+            ParamList params = DefaultParams("POST", 7);
+            std::string encodedParams = EncodeParams(params);
+            std::string request = EncodeRequest(1, params, "a=3&b=4", true);
+
+            printf("%-36s %15s %14s\n", "Benchmark", "Time", "Iterations");
+            printf("%s\n", std::string(67, '-').c_str());
+
+            Micro(options, "RecordBuf/Create+Release", [&]() {
+                RecordBufPtr record(RecordBuf::Create(1, FCGI_STDOUT, 4096));
+                sink += record->header.TotalLength();
+            });
+
+            Micro(options, "EncodeRequest/nginx", [&]() {
+                sink += EncodeRequest(1, params, "a=3&b=4", true).size();
+            });
+
+            Micro(options, "AppendKeyValuePair/nginx", [&]() {
+                std::string out;
+                for (auto& p : params)
+                    AppendKeyValuePair(out, p.first, p.second);
+                sink += out.size();
+            });
+
+            ReceiveBuffer buffer;
+            Micro(options, "ReceiveBuffer/PeekRecord", [&]() {
+                buffer.Reserve((unsigned int)request.size());
+                memcpy(buffer.WritePtr(), request.data(), request.size());
+                buffer.Commit((unsigned int)request.size());
+                RecordView record;
+                unsigned int needed;
+                while (buffer.PeekRecord(record, needed))
+                {
+                    sink += record.header.type;
+                    buffer.Consume(needed);
+                }
+            });
+
+            Micro(options, "ReadKeyValuePair/nginx", [&]() {
+                const char* p = encodedParams.data();
+                const char* endPtr = p + encodedParams.size();
+                std::string key, value;
+                while (p < endPtr)
+                {
+                    p = ReadKeyValuePair(p, key, value);
+                    sink += value.size();
+                }
+            });
+
+            ParamStore store;
+            Micro(options, "ParamStore/Append+Get", [&]() {
+                store.Clear();
+                store.Append(encodedParams.data(), (unsigned int)encodedParams.size());
+                sink += store.Get(ParamRequestMethod).size() + store.Get(ParamScriptName).size();
+            });
+
+            // Same names as the last request on the connection, but the
+            // per-request values differ, as they do behind nginx.
+            std::string changedParams[2];
+            for (int i = 0; i < 2; ++i)
+            {
+                ParamList changed = params;
+                for (auto& param : changed)
+                {
+                    if (param.first == "QUERY_STRING" || param.first == "REMOTE_PORT")
+                        param.second += std::to_string(i * 1000 + 17);
+                }
+                changedParams[i] = EncodeParams(changed);
+            }
+            int turn = 0;
+            Micro(options, "ParamStore/Append+Get changed", [&]() {
+                const std::string& encoded = changedParams[turn ^= 1];
+                store.Clear();
+                store.Append(encoded.data(), (unsigned int)encoded.size());
+                sink += store.Get(ParamRequestMethod).size() + store.Get(ParamScriptName).size();
+            });
+
+            Micro(options, "LookupKnownParam/hit", [&]() {
+                sink += LookupKnownParam("SCRIPT_FILENAME", 15);
+            });
+
+            struct NullHandler : IHandler
+            {
+                void Handle(IRequest&, IResponse&) override {}
+            } handler;
+            Router router;
+            router.Add("", Router::MatchPrefix, &handler);
+            router.Add("/api/", Router::MatchPrefix, &handler);
+            router.Add("/api/v1/users", Router::MatchExact, &handler);
+            router.Add("/api/v1/orders/", Router::MatchPrefix, &handler);
+            router.Add("/static/", Router::MatchPrefix, &handler);
+            router.Add("/healthz", Router::MatchExact, &handler);
+            router.Compile();
+            Micro(options, "Router/Find", [&]() {
+                sink += router.Find("/api/v1/orders/12345") != nullptr;
+            });
+
+            return 0;
+        }
+    };
+};
+
+int main(int argc, char** argv)
+{
+    using namespace SoraFastCGI::Bench;
+
+    std::string mode = argc > 1 ? argv[1] : "";
+    Options options(argc, argv);
+
+    if (mode == "memory")
+        return RunMemory(options);
+    if (mode == "latency")
+        return RunLatency(options);
+    if (mode == "params")
+        return RunParams(options);
+    if (mode == "form")
+        return RunForm(options);
+    if (mode == "log")
+        return RunLog(options);
+    if (mode == "load")
+        return RunLoad(options);
+    if (mode == "micro")
+        return RunMicro(options);
+    if (mode == "startup")
+        return RunStartup(options);
+
+    std::cerr << "usage: " << argv[0] << " memory|latency|params|form|log|load|micro|startup [--name=value ...]" << std::endl;
+    return 1;
+}
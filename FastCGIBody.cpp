@@ -0,0 +1,127 @@
+#include "SoraFastCGI.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        // Memory kept between requests by a cleared body.
+        const std::size_t retainedCapacity = 64 * 1024;
+
+        int OpenTempFile(const std::string& dir)
+        {
+            int fd;
+#ifdef O_TMPFILE
+            fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+            if (fd >= 0)
+                return fd;
+#endif
+            std::string path = dir + "/sorafastcgi-body-XXXXXX";
+            fd = mkostemp(&path[0], O_CLOEXEC);
+            if (fd >= 0)
+                unlink(path.c_str());
+            return fd;
+        }
+
+        bool WriteAll(int fd, const char* data, std::size_t len)
+        {
+            while (len > 0)
+            {
+                ssize_t written = write(fd, data, len);
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                data += written;
+                len -= written;
+            }
+            return true;
+        }
+    }
+
+    RequestBody::RequestBody()
+        : fd_(-1)
+        , size_{}
+        , readPos_{}
+    {
+    }
+
+    RequestBody::~RequestBody()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    bool RequestBody::Append(const char* data, std::size_t len, std::size_t memoryLimit, const std::string& tempDir)
+    {
+        if (fd_ < 0 && memory_.size() + len > memoryLimit)
+        {
+            fd_ = OpenTempFile(tempDir);
+            if (fd_ < 0 || !WriteAll(fd_, memory_.data(), memory_.size()))
+                return false;
+            memory_.clear();
+            if (memory_.capacity() > retainedCapacity)
+                memory_.shrink_to_fit();
+        }
+
+        if (fd_ >= 0)
+        {
+            if (!WriteAll(fd_, data, len))
+                return false;
+        }
+        else
+        {
+            memory_.append(data, len);
+        }
+
+        size_ += len;
+        return true;
+    }
+
+    std::size_t RequestBody::Read(char* buf, std::size_t len)
+    {
+        len = (std::size_t)std::min<unsigned long long>(len, size_ - readPos_);
+        if (len == 0)
+            return 0;
+
+        if (fd_ < 0)
+        {
+            memcpy(buf, memory_.data() + readPos_, len);
+        }
+        else
+        {
+            ssize_t n;
+            do
+            {
+                n = pread(fd_, buf, len, (off_t)readPos_);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0)
+                return 0;
+            len = (std::size_t)n;
+        }
+
+        readPos_ += len;
+        return len;
+    }
+
+    void RequestBody::Clear()
+    {
+        if (fd_ >= 0)
+        {
+            close(fd_);
+            fd_ = -1;
+        }
+        memory_.clear();
+        if (memory_.capacity() > retainedCapacity)
+            memory_.shrink_to_fit();
+        size_ = 0;
+        readPos_ = 0;
+    }
+};
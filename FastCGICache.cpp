@@ -0,0 +1,186 @@
+#include "SoraFastCGI.h"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace SoraFastCGI
+{
+    struct ResponseCache::Stripe
+    {
+        struct Entry
+        {
+            Response response;
+            unsigned long long expiresNs = 0;
+
+            // Set while the request that got the Miss computes the response.
+            bool pending = true;
+            std::vector<Waiter> waiters;
+
+            // Position in the LRU list; only while not pending.
+            std::list<const std::string*>::iterator lru;
+        };
+
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+
+        // Keys of stored responses, most recently used first.
+        std::list<const std::string*> lru;
+        std::size_t bytes = 0;
+
+        // Accounted size of a stored response.
+        static std::size_t Cost(const std::string& key, const Entry& entry)
+        {
+            return key.size() + entry.response->size();
+        }
+
+        void Unlink(const std::string& key, Entry& entry)
+        {
+            bytes -= Cost(key, entry);
+            lru.erase(entry.lru);
+            entry.response.reset();
+        }
+    };
+
+    ResponseCache::ResponseCache(const ServerConfig& config)
+        : ttlNs_(config.cacheTtl * 1000000ull)
+        , stripeBytes_(config.cacheBytes / stripe_count)
+        , stripes_(new Stripe[stripe_count])
+    {
+        std::string_view names = config.cacheKeyParams;
+        while (!names.empty())
+        {
+            std::size_t comma = names.find(',');
+            std::string_view name = names.substr(0, comma);
+            if (!name.empty())
+                keyParams_.emplace_back(name);
+            names = comma == std::string_view::npos ? std::string_view() : names.substr(comma + 1);
+        }
+    }
+
+    ResponseCache::~ResponseCache()
+    {
+    }
+
+    ResponseCache::Stripe& ResponseCache::StripeOf(const std::string& key)
+    {
+        return stripes_[std::hash<std::string>()(key) % stripe_count];
+    }
+
+    void ResponseCache::MakeKey(const ParamStore& params, std::string& key) const
+    {
+        // Each value is preceded by its length, so no two parameter sets
+        // run together into the same key.
+        key.clear();
+        for (const std::string& name : keyParams_)
+        {
+            std::string_view value = params.Get(name);
+            unsigned int len = (unsigned int)value.size();
+            key.append((const char*)&len, sizeof(len));
+            key.append(value.data(), value.size());
+        }
+    }
+
+    ResponseCache::LookupResult ResponseCache::Lookup(const std::string& key, Response& response)
+    {
+        Stripe& stripe = StripeOf(key);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        auto it = stripe.entries.find(key);
+        if (it == stripe.entries.end())
+        {
+            stripe.entries.emplace(key, Stripe::Entry());
+            return Miss;
+        }
+
+        Stripe::Entry& entry = it->second;
+        if (entry.pending)
+            return Pending;
+
+        if (Metrics::Now() < entry.expiresNs)
+        {
+            stripe.lru.splice(stripe.lru.begin(), stripe.lru, entry.lru);
+            response = entry.response;
+            return Hit;
+        }
+
+        // Expired: the caller computes it afresh and others wait for that.
+        stripe.Unlink(it->first, entry);
+        entry.pending = true;
+        return Miss;
+    }
+
+    void ResponseCache::Wait(const std::string& key, Waiter waiter)
+    {
+        Response current;
+        {
+            Stripe& stripe = StripeOf(key);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            auto it = stripe.entries.find(key);
+            if (it != stripe.entries.end())
+            {
+                if (it->second.pending)
+                {
+                    it->second.waiters.push_back(std::move(waiter));
+                    return;
+                }
+                current = it->second.response;
+            }
+        }
+        waiter(current);
+    }
+
+    void ResponseCache::Complete(const std::string& key, Response response)
+    {
+        std::vector<Waiter> waiters;
+        {
+            Stripe& stripe = StripeOf(key);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+
+            auto it = stripe.entries.find(key);
+            if (it == stripe.entries.end())
+                return;
+
+            Stripe::Entry& entry = it->second;
+            waiters.swap(entry.waiters);
+            if (!response || key.size() + response->size() > stripeBytes_)
+            {
+                response.reset();
+                stripe.entries.erase(it);
+            }
+            else
+            {
+                entry.response = response;
+                entry.expiresNs = Metrics::Now() + ttlNs_;
+                entry.pending = false;
+                stripe.lru.push_front(&it->first);
+                entry.lru = stripe.lru.begin();
+                stripe.bytes += Stripe::Cost(key, entry);
+
+                while (stripe.bytes > stripeBytes_)
+                {
+                    auto victim = stripe.entries.find(*stripe.lru.back());
+                    stripe.Unlink(victim->first, victim->second);
+                    stripe.entries.erase(victim);
+                }
+            }
+        }
+
+        for (Waiter& waiter : waiters)
+            waiter(response);
+    }
+
+    std::string ResponseCache::Reframe(const std::string& records, unsigned short reqId)
+    {
+        std::string result(records);
+        std::size_t pos = 0;
+        while (pos + FCGI_HEADER_LEN <= result.size())
+        {
+            SoraFCGIHeader* header = (SoraFCGIHeader*)&result[pos];
+            header->RequestId(reqId);
+            pos += header->TotalLength();
+        }
+        return result;
+    }
+};
@@ -0,0 +1,552 @@
+#include "SoraFastCGI.h"
+
+#include <ctype.h>
+#include <strings.h>
+
+// Delimiter scans compare 32 or 16 bytes at a time with whatever the build
+// targets; x86-64 always has SSE2, AVX2 needs -mavx2 or -march.
+#if !defined(SORA_FCGI_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define SORA_FCGI_FORM_AVX2 1
+#define SORA_FCGI_FORM_SSE2 1
+#elif !defined(SORA_FCGI_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SORA_FCGI_FORM_SSE2 1
+#endif
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        bool IsUrlDelimiter(char c)
+        {
+            return c == '&' || c == '=' || c == '%' || c == '+';
+        }
+
+        // First '&', '=', '%' or '+' in [p, end), or end.
+        const char* FindUrlDelimiter(const char* p, const char* end)
+        {
+#ifdef SORA_FCGI_FORM_AVX2
+            const __m256i amp32 = _mm256_set1_epi8('&');
+            const __m256i eq32 = _mm256_set1_epi8('=');
+            const __m256i pct32 = _mm256_set1_epi8('%');
+            const __m256i plus32 = _mm256_set1_epi8('+');
+            for (; end - p >= 32; p += 32)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i*)p);
+                __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp32), _mm256_cmpeq_epi8(v, eq32)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, pct32), _mm256_cmpeq_epi8(v, plus32)));
+                unsigned int mask = (unsigned int)_mm256_movemask_epi8(hit);
+                if (mask)
+                    return p + __builtin_ctz(mask);
+            }
+#endif
+#ifdef SORA_FCGI_FORM_SSE2
+            const __m128i amp = _mm_set1_epi8('&');
+            const __m128i eq = _mm_set1_epi8('=');
+            const __m128i pct = _mm_set1_epi8('%');
+            const __m128i plus = _mm_set1_epi8('+');
+            for (; end - p >= 16; p += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)p);
+                __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, eq)),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+                unsigned int mask = (unsigned int)_mm_movemask_epi8(hit);
+                if (mask)
+                    return p + __builtin_ctz(mask);
+            }
+#endif
+            while (p < end && !IsUrlDelimiter(*p))
+                ++p;
+            return p;
+        }
+
+        // First occurrence of `needle` (two bytes or more) in [p, end), or
+        // null. The vector loops test the first and last byte of the needle
+        // at every offset at once and only compare the rest on candidates.
+        const char* FindDelimiter(const char* p, const char* end, const std::string& needle)
+        {
+            std::size_t n = needle.size();
+            if ((std::size_t)(end - p) < n)
+                return nullptr;
+            const char* last = end - n;
+
+#ifdef SORA_FCGI_FORM_AVX2
+            const __m256i first32 = _mm256_set1_epi8(needle[0]);
+            const __m256i final32 = _mm256_set1_epi8(needle[n - 1]);
+            for (; last - p >= 31; p += 32)
+            {
+                __m256i head = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), first32);
+                __m256i tail = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + n - 1)), final32);
+                unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(head, tail));
+                for (; mask; mask &= mask - 1)
+                {
+                    const char* candidate = p + __builtin_ctz(mask);
+                    if (memcmp(candidate + 1, needle.data() + 1, n - 2) == 0)
+                        return candidate;
+                }
+            }
+#endif
+#ifdef SORA_FCGI_FORM_SSE2
+            const __m128i first = _mm_set1_epi8(needle[0]);
+            const __m128i final = _mm_set1_epi8(needle[n - 1]);
+            for (; last - p >= 15; p += 16)
+            {
+                __m128i head = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), first);
+                __m128i tail = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + n - 1)), final);
+                unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(head, tail));
+                for (; mask; mask &= mask - 1)
+                {
+                    const char* candidate = p + __builtin_ctz(mask);
+                    if (memcmp(candidate + 1, needle.data() + 1, n - 2) == 0)
+                        return candidate;
+                }
+            }
+#endif
+            while (p <= last)
+            {
+                p = (const char*)memchr(p, needle[0], last - p + 1);
+                if (!p)
+                    return nullptr;
+                if (memcmp(p, needle.data(), n) == 0)
+                    return p;
+                ++p;
+            }
+            return nullptr;
+        }
+
+        // Start of the longest tail of [p, end) that is a proper prefix of
+        // `needle`, or end.
+        const char* FindPartialDelimiter(const char* p, const char* end, const std::string& needle)
+        {
+            const char* from = end - std::min<std::size_t>(end - p, needle.size() - 1);
+            for (; from < end; ++from)
+            {
+                if (*from == needle[0] && memcmp(from, needle.data(), end - from) == 0)
+                    return from;
+            }
+            return end;
+        }
+
+        int HexValue(char c)
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            return (tolower((unsigned char)c) - 'a') + 10;
+        }
+
+        std::string_view Trim(std::string_view text)
+        {
+            while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+                text.remove_prefix(1);
+            while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+                text.remove_suffix(1);
+            return text;
+        }
+
+        bool StartsWithNoCase(std::string_view text, std::string_view prefix)
+        {
+            return text.size() >= prefix.size() && strncasecmp(text.data(), prefix.data(), prefix.size()) == 0;
+        }
+
+        // Value of parameter `name` in a header value such as
+        // `form-data; name="a"; filename="b.txt"`, unquoted.
+        std::string_view HeaderParam(std::string_view value, std::string_view name)
+        {
+            while (!value.empty())
+            {
+                // Parameters end at a ';' outside quotes.
+                std::size_t semicolon = 0;
+                for (bool quoted = false; semicolon < value.size() && (quoted || value[semicolon] != ';'); ++semicolon)
+                {
+                    if (value[semicolon] == '"')
+                        quoted = !quoted;
+                }
+                std::string_view param = Trim(value.substr(0, semicolon));
+                value = semicolon < value.size() ? value.substr(semicolon + 1) : std::string_view();
+
+                std::size_t equals = param.find('=');
+                if (equals == std::string_view::npos || Trim(param.substr(0, equals)).size() != name.size() || !StartsWithNoCase(Trim(param.substr(0, equals)), name))
+                    continue;
+
+                std::string_view result = Trim(param.substr(equals + 1));
+                if (result.size() >= 2 && result.front() == '"' && result.back() == '"')
+                    result = result.substr(1, result.size() - 2);
+                return result;
+            }
+            return std::string_view();
+        }
+    }
+
+    FormParser::FormParser(std::string_view contentType, IFormFieldConsumer& fields)
+        : fields_(fields)
+        , encoding_(Unsupported)
+        , state_(StateFailed)
+        , escape_{}
+        , escapeLen_{}
+    {
+        std::string_view mediaType = Trim(contentType.substr(0, contentType.find(';')));
+        if (mediaType.empty() || (mediaType.size() == 33 && StartsWithNoCase(mediaType, "application/x-www-form-urlencoded")))
+        {
+            encoding_ = UrlEncoded;
+            state_ = StateName;
+        }
+        else if (mediaType.size() == 19 && StartsWithNoCase(mediaType, "multipart/form-data"))
+        {
+            // RFC 2046 boundaries are 1 to 70 characters and never contain
+            // CR or LF, which ScanPart relies on.
+            std::string_view boundary = HeaderParam(contentType, "boundary");
+            if (!boundary.empty() && boundary.size() <= 70 && boundary.find_first_of("\r\n") == std::string_view::npos)
+            {
+                encoding_ = Multipart;
+                state_ = StatePreamble;
+                delimiter_ = "\r\n--";
+                delimiter_.append(boundary.data(), boundary.size());
+
+                // As if the body began with a line break, so a boundary on
+                // the very first line is found like any other.
+                partial_ = "\r\n";
+            }
+        }
+    }
+
+    void FormParser::OnBodyData(const char* data, std::size_t len)
+    {
+        if (encoding_ == UrlEncoded)
+            ParseUrlEncoded(data, data + len);
+        else if (encoding_ == Multipart)
+            ParseMultipart(data, data + len);
+    }
+
+    void FormParser::OnBodyEnd()
+    {
+        if (state_ == StateName || state_ == StateValue)
+        {
+            EndUrlEncodedField();
+            state_ = StateDone;
+        }
+        else if (state_ != StateDone)
+        {
+            // A multipart body that stops before its closing boundary.
+            state_ = StateFailed;
+        }
+    }
+
+    void FormParser::ParseUrlEncoded(const char* p, const char* end)
+    {
+        while (p < end && state_ != StateFailed)
+        {
+            std::string& out = state_ == StateName ? name_ : value_;
+            if (escapeLen_ > 0)
+            {
+                // Not a valid escape: the '%' and what followed stay as they
+                // were, and the current byte is looked at again.
+                if (!isxdigit((unsigned char)*p))
+                {
+                    out.append(escape_, escapeLen_);
+                    escapeLen_ = 0;
+                    continue;
+                }
+                escape_[escapeLen_++] = *p++;
+                if (escapeLen_ == 3)
+                    DecodeEscape(out);
+                continue;
+            }
+
+            // A value with nothing to decode goes out without being copied.
+            const char* stop = FindUrlDelimiter(p, end);
+            if (state_ == StateValue && value_.empty() && (stop == end || *stop == '&'))
+            {
+                if (stop > p)
+                    fields_.OnFieldData(p, stop - p);
+            }
+            else
+            {
+                out.append(p, stop - p);
+            }
+            p = stop;
+            if (p < end)
+            {
+                switch (*p++)
+                {
+                case '+':
+                    out += ' ';
+                    break;
+                case '%':
+                    escape_[0] = '%';
+                    escapeLen_ = 1;
+                    break;
+                case '=':
+                    if (state_ == StateName)
+                    {
+                        fields_.OnFieldBegin(name_, std::string_view());
+                        state_ = StateValue;
+                    }
+                    else
+                    {
+                        out += '=';
+                    }
+                    break;
+                case '&':
+                    EndUrlEncodedField();
+                    break;
+                }
+            }
+
+            if (name_.size() > max_name_len)
+                state_ = StateFailed;
+        }
+
+        // Pass on what this chunk decoded of the value, so it is not held.
+        if (state_ == StateValue && !value_.empty())
+        {
+            fields_.OnFieldData(value_.data(), value_.size());
+            value_.clear();
+        }
+    }
+
+    void FormParser::DecodeEscape(std::string& out)
+    {
+        out += (char)(HexValue(escape_[1]) << 4 | HexValue(escape_[2]));
+        escapeLen_ = 0;
+    }
+
+    void FormParser::EndUrlEncodedField()
+    {
+        std::string& out = state_ == StateName ? name_ : value_;
+        out.append(escape_, escapeLen_);
+        escapeLen_ = 0;
+
+        if (state_ == StateValue)
+        {
+            if (!value_.empty())
+                fields_.OnFieldData(value_.data(), value_.size());
+            fields_.OnFieldEnd();
+        }
+        else if (!name_.empty())
+        {
+            // A bare name is a field with an empty value; "&&" is nothing.
+            fields_.OnFieldBegin(name_, std::string_view());
+            fields_.OnFieldEnd();
+        }
+
+        name_.clear();
+        value_.clear();
+        state_ = StateName;
+    }
+
+    void FormParser::ParseMultipart(const char* p, const char* end)
+    {
+        while (p < end)
+        {
+            switch (state_)
+            {
+            case StatePreamble:
+            case StatePartBody:
+                p = ScanPart(p, end);
+                break;
+
+            case StateDelimiterEnd:
+            {
+                // "--" closes the form; otherwise the line ends, possibly
+                // after transport padding, and part headers follow.
+                char c = *p++;
+                headers_ += c;
+                if (headers_ == "--")
+                {
+                    state_ = StateDone;
+                }
+                else if (c == '\n')
+                {
+                    if (headers_.size() < 2 || headers_[headers_.size() - 2] != '\r' || Trim(std::string_view(headers_).substr(0, headers_.size() - 2)).size() > 0)
+                    {
+                        state_ = StateFailed;
+                        return;
+                    }
+                    // Keeping the line break lets an empty header block end
+                    // on the same "\r\n\r\n" as any other.
+                    headers_ = "\r\n";
+                    state_ = StatePartHeaders;
+                }
+                else if (headers_.size() > 64)
+                {
+                    state_ = StateFailed;
+                    return;
+                }
+                break;
+            }
+
+            case StatePartHeaders:
+            {
+                std::size_t searchFrom = headers_.size() >= 3 ? headers_.size() - 3 : 0;
+                std::size_t room = headers_.size() < max_part_header_len ? max_part_header_len + 1 - headers_.size() : 1;
+                std::size_t take = std::min<std::size_t>(end - p, room);
+                headers_.append(p, take);
+                std::size_t blank = headers_.find("\r\n\r\n", searchFrom);
+                if (blank == std::string::npos)
+                {
+                    if (headers_.size() > max_part_header_len)
+                    {
+                        state_ = StateFailed;
+                        return;
+                    }
+                    p += take;
+                    break;
+                }
+
+                // Hand back what belongs to the body.
+                p += take - (headers_.size() - (blank + 4));
+                headers_.resize(blank + 2);
+                if (!BeginPart())
+                {
+                    state_ = StateFailed;
+                    return;
+                }
+                state_ = StatePartBody;
+                break;
+            }
+
+            default:
+                // Done (the epilogue is ignored) or failed.
+                return;
+            }
+        }
+    }
+
+    // Passes on part data up to the next delimiter and returns the position
+    // after it, or passes on what is certainly data and keeps a tail that
+    // may start the delimiter in partial_ for the next chunk.
+    const char* FormParser::ScanPart(const char* p, const char* end)
+    {
+        if (!partial_.empty())
+        {
+            std::size_t need = delimiter_.size() - partial_.size();
+            std::size_t have = std::min<std::size_t>(need, end - p);
+            if (memcmp(p, delimiter_.data() + partial_.size(), have) != 0)
+            {
+                // Only the first byte of the delimiter is a '\r', so no match
+                // starts inside the kept bytes: all of them are data.
+                PartData(partial_.data(), partial_.size());
+                partial_.clear();
+            }
+            else if (have < need)
+            {
+                partial_.append(p, have);
+                return end;
+            }
+            else
+            {
+                partial_.clear();
+                if (state_ == StatePartBody)
+                    fields_.OnFieldEnd();
+                headers_.clear();
+                state_ = StateDelimiterEnd;
+                return p + have;
+            }
+        }
+
+        const char* match = FindDelimiter(p, end, delimiter_);
+        if (match)
+        {
+            PartData(p, match - p);
+            if (state_ == StatePartBody)
+                fields_.OnFieldEnd();
+            headers_.clear();
+            state_ = StateDelimiterEnd;
+            return match + delimiter_.size();
+        }
+
+        const char* tail = FindPartialDelimiter(p, end, delimiter_);
+        PartData(p, tail - p);
+        partial_.assign(tail, end - tail);
+        return end;
+    }
+
+    bool FormParser::BeginPart()
+    {
+        std::string_view name;
+        std::string_view filename;
+        std::string_view headers(headers_);
+        while (!headers.empty())
+        {
+            std::size_t eol = headers.find("\r\n");
+            std::string_view line = headers.substr(0, eol);
+            headers = eol == std::string_view::npos ? std::string_view() : headers.substr(eol + 2);
+
+            std::size_t colon = line.find(':');
+            if (colon == std::string_view::npos)
+                continue;
+            std::string_view header = Trim(line.substr(0, colon));
+            if (header.size() == 19 && StartsWithNoCase(header, "Content-Disposition"))
+            {
+                std::string_view value = line.substr(colon + 1);
+                name = HeaderParam(value, "name");
+                filename = HeaderParam(value, "filename");
+            }
+        }
+
+        if (name.size() > max_name_len)
+            return false;
+        fields_.OnFieldBegin(name, filename);
+        return true;
+    }
+
+    void FormParser::PartData(const char* data, std::size_t len)
+    {
+        if (state_ == StatePartBody && len > 0)
+            fields_.OnFieldData(data, len);
+    }
+
+    FormFields::FormFields(std::size_t maxBytes)
+        : maxBytes_(maxBytes)
+        , bytes_{}
+        , truncated_{}
+        , open_{}
+    {
+        fields_.reserve(8);
+    }
+
+    void FormFields::OnFieldBegin(std::string_view name, std::string_view filename)
+    {
+        open_ = false;
+        if (bytes_ + name.size() > maxBytes_)
+        {
+            truncated_ = true;
+            return;
+        }
+        fields_.emplace_back(std::string(name), std::string());
+        bytes_ += name.size();
+        open_ = true;
+    }
+
+    void FormFields::OnFieldData(const char* data, std::size_t len)
+    {
+        if (!open_)
+            return;
+        if (bytes_ + len > maxBytes_)
+        {
+            bytes_ -= fields_.back().first.size() + fields_.back().second.size();
+            fields_.pop_back();
+            truncated_ = true;
+            open_ = false;
+            return;
+        }
+        fields_.back().second.append(data, len);
+        bytes_ += len;
+    }
+
+    void FormFields::OnFieldEnd()
+    {
+        open_ = false;
+    }
+
+    std::string_view FormFields::Get(std::string_view name) const
+    {
+        for (auto& field : fields_)
+        {
+            if (field.first == name)
+                return field.second;
+        }
+        return std::string_view();
+    }
+};
@@ -0,0 +1,336 @@
+#include "SoraFastCGI.h"
+
+#include <charconv>
+#include <mutex>
+#include <sstream>
+#include <unordered_set>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        // The calculator only needs a small form, so at most max_form bytes
+        // of fields are kept. Fed while the body arrives when it is
+        // streamed, and from the buffered body otherwise.
+        class CalculatorForm : public IBodyConsumer
+        {
+            FormFields fields_;
+            FormParser parser_;
+
+        public:
+            static const std::size_t max_form = 4096;
+
+            explicit CalculatorForm(const IRequest& request)
+                : fields_(max_form)
+                , parser_(request.Params().Get(ParamContentType), fields_)
+            {
+            }
+
+            void OnBodyData(const char* data, std::size_t len) override
+            {
+                parser_.OnBodyData(data, len);
+            }
+
+            void OnBodyEnd() override
+            {
+                parser_.OnBodyEnd();
+            }
+
+            // Nothing more worth reading: the form is broken or over the limit.
+            bool Complete() const { return parser_.Failed() || fields_.Truncated(); }
+            const FormFields& Fields() const { return fields_; }
+        };
+
+        // Whole of `text`, give or take surrounding blanks, as a decimal int.
+        bool ParseInt(std::string_view text, int& value)
+        {
+            while (!text.empty() && isspace((unsigned char)text.front()))
+                text.remove_prefix(1);
+            while (!text.empty() && isspace((unsigned char)text.back()))
+                text.remove_suffix(1);
+            std::from_chars_result result = std::from_chars(text.data(), text.data() + text.size(), value);
+            return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+        }
+
+        class CalculatorHandler : public IHandler
+        {
+            bool streamBody_;
+
+        public:
+            explicit CalculatorHandler(bool streamBody)
+                : streamBody_(streamBody)
+            {
+            }
+
+            std::unique_ptr<IBodyConsumer> OpenBodyStream(const IRequest& request) override
+            {
+                if (!streamBody_)
+                    return nullptr;
+                return std::unique_ptr<IBodyConsumer>(new CalculatorForm(request));
+            }
+
+            void Handle(IRequest& request, IResponse& response) override
+            {
+                const CalculatorForm* form = static_cast<const CalculatorForm*>(request.BodyConsumer());
+                std::unique_ptr<CalculatorForm> buffered;
+                if (!form)
+                {
+                    buffered.reset(new CalculatorForm(request));
+                    char buf[4096];
+                    std::size_t len;
+                    while (!buffered->Complete() && (len = request.ReadBody(buf, sizeof(buf))) > 0)
+                        buffered->OnBodyData(buf, len);
+                    buffered->OnBodyEnd();
+                    form = buffered.get();
+                }
+
+                std::stringstream ss;
+#if 0
+                response.Header("Content-type", "text/plain");
+
+                const ParamStore& params = request.Params();
+                for (unsigned int i = 0; i < params.Size(); ++i)
+                {
+                    ss << params.Name(i) << " = " << params.Value(i) << '\r' << '\n';
+                }
+
+#else
+                response.Header("Content-type", "text/html");
+                ss << "<html><body>"
+                    "<head><title>calculator</title></head>"
+                    "<form action=? method=POST>"
+                    "<p>a=<input name='a' type='text' /></p>"
+                    "<p>b=<input name='b' type='text' /></p>"
+                    "<p><input type='submit' /></p>"
+                    "</form>";
+
+                if (request.Params().Get(ParamRequestMethod) == "POST")
+                {
+                    int a, b;
+                    if (ParseInt(form->Fields().Get("a"), a) && ParseInt(form->Fields().Get("b"), b))
+                    {
+                        ss << "<p>" << a << "+" << b << "=" << a + b << "</p>";
+                    }
+                    else
+                    {
+                        ss << "<p>invalid parameters</p>";
+                    }
+                }
+
+                ss << "</body></html>";
+#endif
+                response.Write(ss.str());
+            }
+        };
+
+        class StatsHandler : public IHandler
+        {
+        public:
+            // Monitoring should still get through when the server is overloaded.
+            HandlerPriority Priority(const IRequest& request) override
+            {
+                return PriorityHigh;
+            }
+
+            bool Cacheable(const IRequest& request) override
+            {
+                return false;
+            }
+
+            void Handle(IRequest& request, IResponse& response) override
+            {
+                response.Header("Content-type", "text/plain; version=0.0.4");
+                response.Write(Metrics::Format());
+            }
+        };
+
+        // Serves GET requests for regular files below `root` with sendfile,
+        // and hands anything else to `fallback`.
+        //
+        // A request path is taken as a file name relative to root: each of
+        // its segments must be non-empty and neither "." nor "..". The file
+        // is opened through a descriptor of root with RESOLVE_BENEATH, so
+        // symlinks are followed only as long as they stay below root. On
+        // kernels without openat2 the resolved path is checked instead.
+        class StaticFileHandler : public IHandler
+        {
+            // Paths remembered as not served, dropped all at once when full.
+            static const std::size_t max_missing = 4096;
+
+            std::string root_;
+            int rootFd_;
+
+            // root_ with symlinks resolved, for kernels without openat2.
+            std::string realRoot_;
+
+            IHandler* fallback_;
+
+            // Paths Serve found no regular file at. Cacheable runs on the
+            // connection, which must not wait on the disk, so it goes by
+            // these alone: a path is left to the fallback's caching once a
+            // request for it has been passed on. A file created there later
+            // is served once the fallback's cached response expires.
+            std::mutex missingMutex_;
+            std::unordered_set<std::string> missing_;
+
+        public:
+            StaticFileHandler(const std::string& root, IHandler* fallback)
+                : root_(root)
+                , rootFd_(open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC))
+                , fallback_(fallback)
+            {
+                if (rootFd_ < 0)
+                    LogOutput(LogError) << "fail to open document root " << root << " : " << strerror(errno);
+
+                char* real = realpath(root.c_str(), nullptr);
+                if (real)
+                {
+                    realRoot_ = real;
+                    free(real);
+                }
+            }
+
+            // Files already come from the page cache and go out with sendfile;
+            // whatever goes to the fallback is cached as the fallback decides.
+            bool Cacheable(const IRequest& request) override
+            {
+                std::string path;
+                if (FilePath(request, path))
+                {
+                    std::lock_guard<std::mutex> lock(missingMutex_);
+                    if (missing_.count(path) == 0)
+                        return false;
+                }
+                return fallback_->Cacheable(request);
+            }
+
+            std::unique_ptr<IBodyConsumer> OpenBodyStream(const IRequest& request) override
+            {
+                return fallback_->OpenBodyStream(request);
+            }
+
+            void Handle(IRequest& request, IResponse& response) override
+            {
+                if (!Serve(request, response))
+                    fallback_->Handle(request, response);
+            }
+
+        private:
+            // The file a GET request names, relative to root_; false if it
+            // names none.
+            bool FilePath(const IRequest& request, std::string& path) const
+            {
+                if (request.Params().Get(ParamRequestMethod) != "GET")
+                    return false;
+
+                std::string_view uri = request.Path();
+                if (uri.empty() || uri[0] != '/')
+                    return false;
+
+                std::size_t begin = 1;
+                for (;;)
+                {
+                    std::size_t end = std::min(uri.find('/', begin), uri.size());
+                    std::string_view segment = uri.substr(begin, end - begin);
+                    if (segment.empty() || segment == "." || segment == "..")
+                        return false;
+                    if (end == uri.size())
+                        break;
+                    begin = end + 1;
+                }
+
+                path.assign(uri.data() + 1, uri.size() - 1);
+                return true;
+            }
+
+            int OpenFile(const std::string& path) const
+            {
+                if (rootFd_ < 0)
+                    return -1;
+
+                struct open_how how;
+                memset(&how, 0, sizeof(how));
+                how.flags = O_RDONLY | O_CLOEXEC;
+                how.resolve = RESOLVE_BENEATH;
+                int fd = (int)syscall(SYS_openat2, rootFd_, path.c_str(), &how, sizeof(how));
+                if (fd >= 0 || errno != ENOSYS)
+                    return fd;
+
+                std::string full = root_ + "/" + path;
+                char resolved[PATH_MAX];
+                if (realRoot_.empty() || !realpath(full.c_str(), resolved)
+                    || strncmp(resolved, realRoot_.c_str(), realRoot_.size()) != 0 || resolved[realRoot_.size()] != '/')
+                    return -1;
+                return open(resolved, O_RDONLY | O_CLOEXEC);
+            }
+
+            void SetMissing(const std::string& path, bool missing)
+            {
+                std::lock_guard<std::mutex> lock(missingMutex_);
+                if (!missing)
+                {
+                    missing_.erase(path);
+                    return;
+                }
+                if (missing_.size() >= max_missing)
+                    missing_.clear();
+                missing_.insert(path);
+            }
+
+            bool Serve(IRequest& request, IResponse& response)
+            {
+                std::string path;
+                if (!FilePath(request, path))
+                    return false;
+
+                int fd = OpenFile(path);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+                {
+                    if (fd >= 0)
+                        close(fd);
+                    SetMissing(path, true);
+                    return false;
+                }
+                SetMissing(path, false);
+
+                response.Header("Content-type", "application/octet-stream");
+                response.Header("Content-length", std::to_string(st.st_size));
+                if (!response.SendFile(fd, 0, st.st_size))
+                {
+                    // Headers may be out already, so report instead of falling back.
+                    response.Error("fail to send " + path);
+                    response.Exit(1);
+                }
+                close(fd);
+                return true;
+            }
+        };
+    }
+
+    void AddBuiltinRoutes(Router& router, const ServerConfig& config)
+    {
+        IHandler* calculator = new CalculatorHandler(config.bodyMode == "stream");
+        IHandler* fallback = calculator;
+        if (!config.documentRoot.empty())
+            fallback = new StaticFileHandler(config.documentRoot, calculator);
+        router.Add("", Router::MatchPrefix, fallback);
+
+        if (!config.statsPath.empty())
+            router.Add(config.statsPath, Router::MatchExact, new StatsHandler());
+
+        router.Compile();
+    }
+};
@@ -0,0 +1,303 @@
+#include "SoraFastCGI.h"
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        // Per-thread ring size; a power of two. Messages are stored as a
+        // 2-byte length and the encoded LogLine, padded to an even size so a
+        // wrap marker always fits at the end of the ring.
+        const std::size_t ringSize = 64 * 1024;
+        const unsigned short wrapMarker = 0xffff;
+
+        static_assert(LogLine::max_size + 4 < ringSize / 2, "a log line must fit in the ring");
+
+        using Counter = std::atomic<unsigned long long>;
+
+        // Single producer (the owning thread), single consumer (the logger).
+        struct LogRing
+        {
+            std::atomic<std::size_t> head{};
+            std::atomic<std::size_t> tail{};
+            Counter dropped{};
+            std::atomic<bool> retired{};
+            char data[ringSize];
+
+            bool Push(const char* msg, unsigned short len)
+            {
+                std::size_t entryLen = (2 + len + 1) & ~(std::size_t)1;
+                std::size_t h = head.load(std::memory_order_relaxed);
+                std::size_t pos = h & (ringSize - 1);
+                std::size_t waste = ringSize - pos < entryLen ? ringSize - pos : 0;
+
+                if (ringSize - (h - tail.load(std::memory_order_acquire)) < waste + entryLen)
+                {
+                    dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    return false;
+                }
+
+                if (waste)
+                {
+                    memcpy(data + pos, &wrapMarker, 2);
+                    h += waste;
+                    pos = 0;
+                }
+                memcpy(data + pos, &len, 2);
+                memcpy(data + pos + 2, msg, len);
+                head.store(h + entryLen, std::memory_order_release);
+                return true;
+            }
+        };
+
+        const char* const levelPrefix[] = { "", "warning: ", "", "debug: " };
+
+        void Format(const char* msg, unsigned short len, std::string& out)
+        {
+            const char* p = msg;
+            const char* end = msg + len;
+            LogLevel level = (LogLevel)*p++;
+            out += levelPrefix[level];
+
+            char num[32];
+            while (p < end)
+            {
+                char tag = *p++;
+                if (tag == 's')
+                {
+                    unsigned short slen;
+                    memcpy(&slen, p, 2);
+                    out.append(p + 2, slen);
+                    p += 2 + slen;
+                }
+                else if (tag == 'c')
+                {
+                    out += *p++;
+                }
+                else if (tag == 'i')
+                {
+                    long long v;
+                    memcpy(&v, p, sizeof(v));
+                    p += sizeof(v);
+                    out.append(num, std::to_chars(num, num + sizeof(num), v).ptr);
+                }
+                else if (tag == 'u')
+                {
+                    unsigned long long v;
+                    memcpy(&v, p, sizeof(v));
+                    p += sizeof(v);
+                    out.append(num, std::to_chars(num, num + sizeof(num), v).ptr);
+                }
+                else if (tag == 'd')
+                {
+                    double v;
+                    memcpy(&v, p, sizeof(v));
+                    p += sizeof(v);
+                    out.append(num, snprintf(num, sizeof(num), "%g", v));
+                }
+                else
+                {
+                    break;
+                }
+            }
+            out += '\n';
+        }
+
+        struct Logger
+        {
+            std::mutex mutex;
+            std::vector<std::shared_ptr<LogRing>> rings;
+            std::thread thread;
+            std::atomic<bool> running{};
+
+            // Drops of rings whose threads have exited and been drained.
+            Counter retiredDropped{};
+            Counter written{};
+            unsigned long long reportedDropped = 0;
+            std::string out;
+
+            void Register(const std::shared_ptr<LogRing>& ring)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                rings.push_back(ring);
+            }
+
+            unsigned long long Dropped()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                unsigned long long total = retiredDropped.load(std::memory_order_relaxed);
+                for (auto& ring : rings)
+                    total += ring->dropped.load(std::memory_order_relaxed);
+                return total;
+            }
+
+            // Formats everything queued in one ring; returns the message count.
+            unsigned long long Drain(LogRing& ring)
+            {
+                unsigned long long count = 0;
+                std::size_t t = ring.tail.load(std::memory_order_relaxed);
+                std::size_t h = ring.head.load(std::memory_order_acquire);
+                while (t != h)
+                {
+                    std::size_t pos = t & (ringSize - 1);
+                    unsigned short len;
+                    memcpy(&len, ring.data + pos, 2);
+                    if (len == wrapMarker)
+                    {
+                        t += ringSize - pos;
+                        continue;
+                    }
+                    Format(ring.data + pos + 2, len, out);
+                    t += (2 + len + 1) & ~(std::size_t)1;
+                    ++count;
+                }
+                ring.tail.store(t, std::memory_order_release);
+                return count;
+            }
+
+            bool DrainAll()
+            {
+                std::vector<std::shared_ptr<LogRing>> current;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    current = rings;
+                }
+
+                unsigned long long count = 0;
+                for (auto& ring : current)
+                {
+                    // Checked before draining, so the last messages of an
+                    // exiting thread are written before its ring goes.
+                    bool retired = ring->retired.load(std::memory_order_acquire);
+                    count += Drain(*ring);
+                    if (retired)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        retiredDropped.fetch_add(ring->dropped.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                        rings.erase(std::find(rings.begin(), rings.end(), ring));
+                    }
+                }
+
+                unsigned long long dropped = Dropped();
+                if (dropped != reportedDropped)
+                {
+                    char num[32];
+                    out += levelPrefix[LogWarning];
+                    out += "log: ";
+                    out.append(num, std::to_chars(num, num + sizeof(num), dropped - reportedDropped).ptr);
+                    out += " messages dropped\n";
+                    reportedDropped = dropped;
+                }
+
+                if (!out.empty())
+                {
+                    written.fetch_add(count, std::memory_order_relaxed);
+                    WriteOut();
+                }
+                return count > 0;
+            }
+
+            void WriteOut()
+            {
+                const char* p = out.data();
+                std::size_t left = out.size();
+                while (left > 0)
+                {
+                    ssize_t n = write(STDERR_FILENO, p, left);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        break;
+                    p += n;
+                    left -= n;
+                }
+                out.clear();
+            }
+
+            void Run()
+            {
+                // Polls with a growing pause while idle, so producers never
+                // have to wake the logger.
+                auto idle = std::chrono::milliseconds(1);
+                while (running.load(std::memory_order_acquire))
+                {
+                    if (DrainAll())
+                        idle = std::chrono::milliseconds(1);
+                    else
+                    {
+                        std::this_thread::sleep_for(idle);
+                        idle = std::min(idle * 2, std::chrono::milliseconds(16));
+                    }
+                }
+                DrainAll();
+            }
+        };
+
+        Logger& GetLogger()
+        {
+            static Logger* logger = new Logger();
+            return *logger;
+        }
+
+        struct ThreadRing
+        {
+            std::shared_ptr<LogRing> ring = std::make_shared<LogRing>();
+
+            ThreadRing()
+            {
+                GetLogger().Register(ring);
+            }
+
+            ~ThreadRing()
+            {
+                ring->retired.store(true, std::memory_order_release);
+            }
+        };
+
+        LogRing& LocalRing()
+        {
+            thread_local ThreadRing ring;
+            return *ring.ring;
+        }
+    }
+
+    LogLine::~LogLine()
+    {
+        LocalRing().Push(buf_, (unsigned short)size_);
+    }
+
+    void StartLogger()
+    {
+        Logger& logger = GetLogger();
+        if (logger.running.exchange(true))
+            return;
+        logger.thread = std::thread([&logger]() { logger.Run(); });
+    }
+
+    void StopLogger()
+    {
+        Logger& logger = GetLogger();
+        if (!logger.running.exchange(false))
+            return;
+        logger.thread.join();
+    }
+
+    LogStats GetLogStats()
+    {
+        Logger& logger = GetLogger();
+        LogStats stats;
+        stats.written = logger.written.load(std::memory_order_relaxed);
+        stats.dropped = logger.Dropped();
+        return stats;
+    }
+};
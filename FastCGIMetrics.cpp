@@ -0,0 +1,226 @@
+#include "SoraFastCGI.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        // Log-linear buckets in the style of HdrHistogram: values below 16 get
+        // a bucket each, above that every power of two is split into 16
+        // buckets, so any recorded value is within about 6% of its bucket.
+        const unsigned int subBucketBits = 4;
+        const unsigned int subBuckets = 1 << subBucketBits;
+        const unsigned int bucketCount = (64 - subBucketBits + 1) * subBuckets;
+
+        unsigned int BucketOf(unsigned long long v)
+        {
+            if (v < subBuckets)
+                return (unsigned int)v;
+            unsigned int msb = 63 - __builtin_clzll(v);
+            return (msb - subBucketBits + 1) * subBuckets + (unsigned int)((v >> (msb - subBucketBits)) & (subBuckets - 1));
+        }
+
+        // Smallest value that falls in bucket `i`.
+        unsigned long long BucketFloor(unsigned int i)
+        {
+            if (i < subBuckets)
+                return i;
+            unsigned int msb = i / subBuckets + subBucketBits - 1;
+            return (unsigned long long)(subBuckets + i % subBuckets) << (msb - subBucketBits);
+        }
+
+        using Counter = std::atomic<unsigned long long>;
+
+        // Only the owning thread writes, so a relaxed load/store pair is enough.
+        inline void Bump(Counter& c, unsigned long long n)
+        {
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        struct Snapshot
+        {
+            unsigned long long counters[Metrics::CounterCount] = {};
+            unsigned long long records[Metrics::record_type_slots] = {};
+            unsigned long long buckets[Metrics::HistogramCount][bucketCount] = {};
+            unsigned long long sums[Metrics::HistogramCount] = {};
+        };
+
+        struct ThreadMetrics;
+
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<ThreadMetrics*> threads;
+            Snapshot retired;
+        };
+
+        Registry& GetRegistry()
+        {
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        struct ThreadMetrics
+        {
+            Counter counters[Metrics::CounterCount] = {};
+            Counter records[Metrics::record_type_slots] = {};
+            Counter buckets[Metrics::HistogramCount][bucketCount] = {};
+            Counter sums[Metrics::HistogramCount] = {};
+
+            ThreadMetrics()
+            {
+                Registry& registry = GetRegistry();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                registry.threads.push_back(this);
+            }
+
+            ~ThreadMetrics()
+            {
+                Registry& registry = GetRegistry();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                AddTo(registry.retired);
+                registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+            }
+
+            void AddTo(Snapshot& snapshot) const
+            {
+                for (int i = 0; i < Metrics::CounterCount; ++i)
+                    snapshot.counters[i] += counters[i].load(std::memory_order_relaxed);
+                for (unsigned int i = 0; i < Metrics::record_type_slots; ++i)
+                    snapshot.records[i] += records[i].load(std::memory_order_relaxed);
+                for (int h = 0; h < Metrics::HistogramCount; ++h)
+                {
+                    for (unsigned int i = 0; i < bucketCount; ++i)
+                        snapshot.buckets[h][i] += buckets[h][i].load(std::memory_order_relaxed);
+                    snapshot.sums[h] += sums[h].load(std::memory_order_relaxed);
+                }
+            }
+        };
+
+        ThreadMetrics& LocalMetrics()
+        {
+            thread_local ThreadMetrics metrics;
+            return metrics;
+        }
+
+        const char* const recordTypeNames[Metrics::record_type_slots] = {
+            "invalid", "BEGIN_REQUEST", "ABORT_REQUEST", "END_REQUEST", "PARAMS", "STDIN", "STDOUT",
+            "STDERR", "DATA", "GET_VALUES", "GET_VALUES_RESULT", "UNKNOWN_TYPE", "other"
+        };
+
+        const char* const histogramNames[Metrics::HistogramCount] = {
+            "params_decode", "handler", "write_stall", "request", "handler_queue"
+        };
+
+        void FormatHistogram(std::ostream& out, const char* name, const unsigned long long* buckets, unsigned long long sumNs)
+        {
+            static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+            unsigned long long count = 0;
+            for (unsigned int i = 0; i < bucketCount; ++i)
+                count += buckets[i];
+
+            out << "# TYPE sorafcgi_" << name << "_seconds summary\n";
+            for (double q : quantiles)
+            {
+                unsigned long long rank = (unsigned long long)(q * count);
+                unsigned long long seen = 0;
+                unsigned long long value = 0;
+                for (unsigned int i = 0; i < bucketCount && count > 0; ++i)
+                {
+                    seen += buckets[i];
+                    if (seen > rank)
+                    {
+                        value = BucketFloor(i);
+                        break;
+                    }
+                }
+                out << "sorafcgi_" << name << "_seconds{quantile=\"" << q << "\"} " << value / 1e9 << "\n";
+            }
+            out << "sorafcgi_" << name << "_seconds_sum " << sumNs / 1e9 << "\n";
+            out << "sorafcgi_" << name << "_seconds_count " << count << "\n";
+        }
+    }
+
+    void Metrics::Add(Counter counter, unsigned long long n)
+    {
+        Bump(LocalMetrics().counters[counter], n);
+    }
+
+    void Metrics::AddRecord(unsigned char type)
+    {
+        Bump(LocalMetrics().records[type <= FCGI_MAXTYPE ? type : FCGI_MAXTYPE + 1], 1);
+    }
+
+    void Metrics::Record(Histogram histogram, unsigned long long ns)
+    {
+        ThreadMetrics& metrics = LocalMetrics();
+        Bump(metrics.buckets[histogram][BucketOf(ns)], 1);
+        Bump(metrics.sums[histogram], ns);
+    }
+
+    unsigned long long Metrics::Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::string Metrics::Format()
+    {
+        std::unique_ptr<Snapshot> snapshot(new Snapshot());
+        {
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            *snapshot = registry.retired;
+            for (ThreadMetrics* metrics : registry.threads)
+                metrics->AddTo(*snapshot);
+        }
+
+        const unsigned long long* c = snapshot->counters;
+        std::ostringstream out;
+        out << "# TYPE sorafcgi_accepts_total counter\n"
+            << "sorafcgi_accepts_total " << c[Accepts] << "\n"
+            << "# TYPE sorafcgi_connections_active gauge\n"
+            << "sorafcgi_connections_active " << (long long)(c[ConnectionsOpened] - c[ConnectionsClosed]) << "\n"
+            << "# TYPE sorafcgi_connections_rejected_total counter\n"
+            << "sorafcgi_connections_rejected_total " << c[ConnectionsRejected] << "\n"
+            << "# TYPE sorafcgi_connections_timed_out_total counter\n"
+            << "sorafcgi_connections_timed_out_total " << c[ConnectionsTimedOut] << "\n"
+            << "# TYPE sorafcgi_requests_total counter\n"
+            << "sorafcgi_requests_total " << c[RequestsStarted] << "\n"
+            << "# TYPE sorafcgi_requests_rejected_total counter\n"
+            << "sorafcgi_requests_rejected_total " << c[RequestsRejected] << "\n"
+            << "# TYPE sorafcgi_requests_shed_total counter\n"
+            << "sorafcgi_requests_shed_total " << c[RequestsShed] << "\n"
+            << "# TYPE sorafcgi_requests_cancelled_total counter\n"
+            << "sorafcgi_requests_cancelled_total " << c[RequestsCancelled] << "\n"
+            << "# TYPE sorafcgi_cache_hits_total counter\n"
+            << "sorafcgi_cache_hits_total " << c[CacheHits] << "\n"
+            << "# TYPE sorafcgi_cache_misses_total counter\n"
+            << "sorafcgi_cache_misses_total " << c[CacheMisses] << "\n"
+            << "# TYPE sorafcgi_cache_coalesced_total counter\n"
+            << "sorafcgi_cache_coalesced_total " << c[CacheCoalesced] << "\n"
+            << "# TYPE sorafcgi_requests_active gauge\n"
+            << "sorafcgi_requests_active " << (long long)(c[RequestsStarted] - c[RequestsFinished]) << "\n"
+            << "# TYPE sorafcgi_bytes_in_total counter\n"
+            << "sorafcgi_bytes_in_total " << c[BytesIn] << "\n"
+            << "# TYPE sorafcgi_bytes_out_total counter\n"
+            << "sorafcgi_bytes_out_total " << c[BytesOut] << "\n";
+
+        out << "# TYPE sorafcgi_records_total counter\n";
+        for (unsigned int i = 0; i < record_type_slots; ++i)
+        {
+            if (snapshot->records[i])
+                out << "sorafcgi_records_total{type=\"" << recordTypeNames[i] << "\"} " << snapshot->records[i] << "\n";
+        }
+
+        for (int h = 0; h < HistogramCount; ++h)
+            FormatHistogram(out, histogramNames[h], snapshot->buckets[h], snapshot->sums[h]);
+
+        return out.str();
+    }
+};
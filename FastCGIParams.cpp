@@ -0,0 +1,117 @@
+#include "SoraFastCGI.h"
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        const char* const knownParamNames[KnownParamCount] = {
+#define SORA_FCGI_PARAM_NAME(id, name) name,
+            SORA_FCGI_KNOWN_PARAMS(SORA_FCGI_PARAM_NAME)
+#undef SORA_FCGI_PARAM_NAME
+        };
+
+        unsigned int HashName(const char* name, unsigned int len)
+        {
+            unsigned int hash = 2166136261u;
+            for (unsigned int i = 0; i < len; ++i)
+                hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+            return hash ^ len;
+        }
+
+        // Open-addressed table from name hash to KnownParam, filled once.
+        struct KnownParamTable
+        {
+            static const unsigned int size = 128;
+
+            unsigned char slot[size];
+            unsigned short nameLen[KnownParamCount];
+
+            KnownParamTable()
+            {
+                for (auto& s : slot)
+                    s = UnknownParam;
+
+                for (int i = 0; i < KnownParamCount; ++i)
+                {
+                    nameLen[i] = (unsigned short)strlen(knownParamNames[i]);
+                    unsigned int pos = HashName(knownParamNames[i], nameLen[i]) & (size - 1);
+                    while (slot[pos] != UnknownParam)
+                        pos = (pos + 1) & (size - 1);
+                    slot[pos] = (unsigned char)i;
+                }
+            }
+        };
+
+        const KnownParamTable& GetKnownParamTable()
+        {
+            static const KnownParamTable table;
+            return table;
+        }
+    }
+
+    KnownParam LookupKnownParam(const char* name, unsigned int len)
+    {
+        const KnownParamTable& table = GetKnownParamTable();
+        for (unsigned int pos = HashName(name, len) & (table.size - 1);; pos = (pos + 1) & (table.size - 1))
+        {
+            unsigned int i = table.slot[pos];
+            if (i == UnknownParam)
+                return UnknownParam;
+            if (table.nameLen[i] == len && memcmp(knownParamNames[i], name, len) == 0)
+                return (KnownParam)i;
+        }
+    }
+
+    bool ParamStore::Append(const char* data, unsigned int len)
+    {
+        if (arena_.size() + len > max_params_bytes)
+            return false;
+
+        arena_.insert(arena_.end(), data, data + len);
+
+        const char* base = arena_.data();
+        const char* endPtr = base + arena_.size();
+        for (;;)
+        {
+            unsigned int nameLen, valueLen;
+            const char* bodyPtr = ReadKeyValueLengths(base + decoded_, endPtr, nameLen, valueLen);
+            if (!bodyPtr)
+                break;
+
+            Entry entry;
+            entry.nameOffset = (unsigned int)(bodyPtr - base);
+            entry.nameLen = nameLen;
+            entry.valueOffset = entry.nameOffset + nameLen;
+            entry.valueLen = valueLen;
+
+            std::size_t index = entries_.size();
+            const Entry* previous = index < previousEntries_.size() ? &previousEntries_[index] : nullptr;
+            if (previous && previous->nameLen == nameLen && memcmp(previousArena_.data() + previous->nameOffset, bodyPtr, nameLen) == 0)
+                entry.param = previous->param;
+            else
+                entry.param = LookupKnownParam(bodyPtr, nameLen);
+            if (entry.param != UnknownParam)
+                known_[entry.param] = (int)index;
+
+            entries_.push_back(entry);
+            decoded_ = entry.valueOffset + valueLen;
+        }
+
+        return true;
+    }
+
+    std::string_view ParamStore::Get(std::string_view name) const
+    {
+        KnownParam param = LookupKnownParam(name.data(), (unsigned int)name.size());
+        if (param != UnknownParam)
+            return Get(param);
+
+        // Later duplicates win, matching the behaviour of a map insert.
+        for (unsigned int i = Size(); i-- > 0;)
+        {
+            if (Name(i) == name)
+                return Value(i);
+        }
+        return std::string_view();
+    }
+};
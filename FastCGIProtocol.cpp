@@ -1,472 +1,3373 @@
 #include <memory>
+#include <utility>
 #include <thread>
-#include <istream>
 #include <iostream>
 #include <sstream>
 #include <atomic>
+#include <mutex>
+#include <deque>
+#include <limits>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <functional>
+#include <iterator>
 
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
 
+// Stackless connection coroutines need a C++20 build; Boost.Asio announces
+// support with BOOST_ASIO_HAS_CO_AWAIT.
+#ifdef BOOST_ASIO_HAS_CO_AWAIT
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#define SORA_FCGI_HAS_AWAITABLE 1
+#endif
+
 #include "SoraFastCGI.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 namespace asio = boost::asio;
 using boost::system::error_code;
 using boost::system::system_error;
 namespace errc = boost::system::errc;
 
-#if 1
-asio::io_service log_service;
 
-class LogOutput : public std::stringstream
+namespace SoraFastCGI
 {
-public:
-    ~LogOutput()
+    // Records waiting to be written on one connection. Headers live inside the
+    // queue and payloads are owned RecordBufs, owned strings or borrowed
+    // pointers, so a whole response goes out as one vectored write without
+    // copying the body. Shared strings of ready-made records, as the
+    // response cache holds them, go out without a header of their own.
+    class OutputQueue
     {
-        *this << std::endl;
-        std::string msg = str();
-        log_service.post([msg]() {
-            std::cerr << msg;
-        });
-    }
-};
-#else
-class LogOutput
-{
-public:
-    template<class T>
-    LogOutput& operator << (const T& x) { return *this; }
-};
-#endif
+    public:
+        // An open file whose bytes go to the socket with sendfile(2).
+        struct FileSource
+        {
+            int fd;
+
+            explicit FileSource(int fd)
+                : fd(fd)
+            {
+            }
+
+            ~FileSource()
+            {
+                close(fd);
+            }
+        };
+
+        // File payload of the record whose header ends a NextBuffers batch.
+        struct FileSlice
+        {
+            int fd;
+            unsigned long long offset;
+            unsigned int length;
+        };
+
+    private:
+        struct Entry
+        {
+            SoraFCGIHeader header;
+            const char* payload;
+            unsigned int payloadLen;
+            RecordBufPtr owner;
+            std::shared_ptr<FileSource> file{};
+            unsigned long long fileOffset = 0;
+
+            // The payload already holds complete records and `header` is unused.
+            bool framed = false;
+        };
+
+        std::vector<Entry> entries_;
+        std::vector<std::unique_ptr<std::string>> strings_;
+        std::vector<std::shared_ptr<const std::string>> shared_;
+        std::vector<asio::const_buffer> buffers_;
+        unsigned int queuedBytes_;
+
+        // First entry not yet returned by NextBuffers.
+        std::size_t next_;
+
+    public:
+        OutputQueue()
+            : queuedBytes_{}
+            , next_{}
+        {
+        }
+
+        OutputQueue(OutputQueue&&) = default;
+        OutputQueue& operator=(OutputQueue&&) = default;
+
+        bool Empty() const { return entries_.empty(); }
+        unsigned int QueuedBytes() const { return queuedBytes_; }
+
+        void Push(RecordBufPtr record)
+        {
+            Entry entry{ record->header, record->content, record->header.BodyLength(), std::move(record) };
+            queuedBytes_ += FCGI_HEADER_LEN + entry.payloadLen;
+            entries_.push_back(std::move(entry));
+        }
+
+        // `data` is referenced, not copied, and must outlive the write.
+        void Push(unsigned short reqId, unsigned char type, const char* data, unsigned short len)
+        {
+            Entry entry{ {}, data, len, nullptr };
+            entry.header.version = FCGI_VERSION_1;
+            entry.header.type = type;
+            entry.header.RequestId(reqId);
+            entry.header.ContentLength(len);
+            queuedBytes_ += FCGI_HEADER_LEN + len;
+            entries_.push_back(std::move(entry));
+        }
+
+        // Takes the string and frames it as one or more records of `type`.
+        void Push(unsigned short reqId, unsigned char type, std::string&& data)
+        {
+            strings_.emplace_back(new std::string(std::move(data)));
+            const char* ptr = strings_.back()->data();
+            std::size_t len = strings_.back()->size();
+            while (len > 0)
+            {
+                unsigned short curlen = (unsigned short)std::min<std::size_t>(len, ushort_max);
+                Push(reqId, type, ptr, curlen);
+                ptr += curlen;
+                len -= curlen;
+            }
+        }
+
+        // Frames [offset, offset + length) of `file` as records of `type`.
+        // Only the headers are held in memory; the payload stays in the file.
+        void Push(unsigned short reqId, unsigned char type, const std::shared_ptr<FileSource>& file, unsigned long long offset, unsigned long long length)
+        {
+            while (length > 0)
+            {
+                unsigned short curlen = (unsigned short)std::min<unsigned long long>(length, ushort_max);
+                Entry entry{ {}, nullptr, curlen, nullptr, file, offset };
+                entry.header.version = FCGI_VERSION_1;
+                entry.header.type = type;
+                entry.header.RequestId(reqId);
+                entry.header.ContentLength(curlen);
+                queuedBytes_ += FCGI_HEADER_LEN;
+                entries_.push_back(std::move(entry));
+
+                offset += curlen;
+                length -= curlen;
+            }
+        }
+
+        // Queues `records`, which already are complete records, as they are.
+        void Push(std::shared_ptr<const std::string> records)
+        {
+            Entry entry{ {}, records->data(), (unsigned int)records->size(), nullptr };
+            entry.framed = true;
+            queuedBytes_ += entry.payloadLen;
+            entries_.push_back(std::move(entry));
+            shared_.push_back(std::move(records));
+        }
+
+        // Appends the queued records to `out` as they go to the peer; false
+        // if a payload is still in a file.
+        bool Serialize(std::string& out) const
+        {
+            for (const Entry& entry : entries_)
+            {
+                if (entry.file)
+                    return false;
+                if (!entry.framed)
+                    out.append((const char*)&entry.header, FCGI_HEADER_LEN);
+                out.append(entry.payload, entry.payloadLen);
+            }
+            return true;
+        }
+
+        void Append(OutputQueue&& other)
+        {
+            if (entries_.empty())
+            {
+                std::swap(entries_, other.entries_);
+                std::swap(strings_, other.strings_);
+                std::swap(shared_, other.shared_);
+            }
+            else
+            {
+                std::move(other.entries_.begin(), other.entries_.end(), std::back_inserter(entries_));
+                std::move(other.strings_.begin(), other.strings_.end(), std::back_inserter(strings_));
+                std::move(other.shared_.begin(), other.shared_.end(), std::back_inserter(shared_));
+            }
+            queuedBytes_ += other.queuedBytes_;
+            other.Clear();
+        }
+
+        void Swap(OutputQueue& other)
+        {
+            std::swap(entries_, other.entries_);
+            std::swap(strings_, other.strings_);
+            std::swap(shared_, other.shared_);
+            std::swap(queuedBytes_, other.queuedBytes_);
+            std::swap(next_, other.next_);
+        }
+
+        // Buffer sequence covering the records after the last call, up to and
+        // including the header of the next file-backed record, whose payload
+        // is returned in `slice` (length 0 if there is none). Empty once
+        // everything has been handed out; valid until the next call or Clear.
+        const std::vector<asio::const_buffer>& NextBuffers(FileSlice& slice)
+        {
+            buffers_.clear();
+            slice = FileSlice{ -1, 0, 0 };
+            while (next_ < entries_.size())
+            {
+                Entry& entry = entries_[next_++];
+                if (!entry.framed)
+                    buffers_.push_back(asio::buffer(&entry.header, FCGI_HEADER_LEN));
+                if (entry.file)
+                {
+                    slice = FileSlice{ entry.file->fd, entry.fileOffset, entry.payloadLen };
+                    break;
+                }
+                if (entry.payloadLen > 0)
+                    buffers_.push_back(asio::buffer(entry.payload, entry.payloadLen));
+            }
+            return buffers_;
+        }
+
+        void Clear()
+        {
+            entries_.clear();
+            strings_.clear();
+            shared_.clear();
+            buffers_.clear();
+            queuedBytes_ = 0;
+            next_ = 0;
+        }
+
+        // Gives back the capacity the vectors grew to; only while empty.
+        void ReleaseMemory()
+        {
+            if (!entries_.empty())
+                return;
+            std::vector<Entry>().swap(entries_);
+            std::vector<std::unique_ptr<std::string>>().swap(strings_);
+            std::vector<std::shared_ptr<const std::string>>().swap(shared_);
+            std::vector<asio::const_buffer>().swap(buffers_);
+        }
+    };
+
+    // A request body handed to an IBodyConsumer while it is still arriving.
+    struct BodyStream
+    {
+        std::unique_ptr<IBodyConsumer> consumer;
+
+        // Keeps chunks, the end of the body and the handler in order.
+        asio::strand<asio::io_service::executor_type> strand;
+
+        // Bytes posted to the consumer but not yet consumed.
+        std::atomic<long long> pending;
+
+        // Set while the connection has stopped reading because of this stream.
+        std::atomic<bool> throttled;
+
+        BodyStream(asio::io_service& handlerService, std::unique_ptr<IBodyConsumer> consumer)
+            : consumer(std::move(consumer))
+            , strand(asio::make_strand(handlerService))
+            , pending{}
+            , throttled{}
+        {
+        }
+    };
 
-namespace SoraFastCGI
-{
     class IRecordSender
     {
     public:
-        virtual bool SendBufferAndDelete(RecordBuf*) = 0;
+        // Hands records over for writing; callable from any thread. Batches
+        // are written in the order they are submitted.
+        virtual void Submit(OutputQueue&& records) = 0;
+
+        // Runs `handler` for request `reqId` outside the reading coroutine,
+        // on `strand` if given and otherwise through the handler queue in
+        // class `priority`, then recycles the request's Worker on the
+        // connection.
+        virtual void Execute(unsigned short reqId, std::function<void()> handler, HandlerPriority priority, asio::strand<asio::io_service::executor_type>* strand = nullptr) = 0;
+
+        // Like Execute through the handler queue, except that `handler` is
+        // queued only once the returned function is called, from any thread.
+        // The request counts as handled from now on.
+        virtual std::function<void()> Defer(unsigned short reqId, std::function<void()> handler, HandlerPriority priority) = 0;
+
+        // Passes a STDIN chunk to the stream's consumer on the handler pool.
+        // Reading pauses while the consumer is more than bodyStreamWindow behind.
+        virtual void StreamBody(const std::shared_ptr<BodyStream>& stream, RecordBufPtr chunk) = 0;
+
+        virtual asio::io_service& HandlerService() = 0;
+
+        // Requests currently being served on this connection, excluding the
+        // one whose BEGIN_REQUEST is being processed.
+        virtual unsigned int ActiveRequests() = 0;
+    };
+
+    // Process-wide limits on requests in flight and on the bytes buffered for
+    // them (request bodies plus responses waiting to be written). Requests
+    // past either limit are turned away with FCGI_OVERLOADED. Also counts
+    // open connections against maxConnections.
+    //
+    // On top of that, a CoDel-style controller watches how long runnable
+    // requests wait for a handler. A burst that drains on its own is fine,
+    // but when the shortest wait of a whole shedInterval is above
+    // shedTarget there is a standing queue, and new requests are shed until
+    // no request is left waiting.
+    class AdmissionControl
+    {
+        const ServerConfig& config_;
+        std::atomic<unsigned int> requests_;
+        std::atomic<long long> queuedBytes_;
+        std::atomic<unsigned int> connections_;
+
+        std::atomic<unsigned long long> intervalEnd_;
+        std::atomic<unsigned long long> minDelay_;
+        std::atomic<bool> shedding_;
+
+        // Requests with a complete body whose handler has not started.
+        std::atomic<int> waiting_;
+
+        // The first caller past the end of an interval judges it.
+        void EndInterval(unsigned long long now)
+        {
+            unsigned long long end = intervalEnd_.load(std::memory_order_relaxed);
+            if (now < end || !intervalEnd_.compare_exchange_strong(end, now + config_.shedInterval * 1000000ull, std::memory_order_relaxed))
+                return;
+
+            unsigned long long minDelay = minDelay_.exchange(std::numeric_limits<unsigned long long>::max(), std::memory_order_relaxed);
+            bool shedding = minDelay != std::numeric_limits<unsigned long long>::max() && minDelay > config_.shedTarget * 1000000ull;
+            if (shedding && !shedding_.exchange(true, std::memory_order_relaxed))
+                LogOutput(LogInfo) << "queue delay above target, shedding new requests";
+        }
+
+    public:
+        AdmissionControl(const ServerConfig& config)
+            : config_(config)
+            , requests_{}
+            , queuedBytes_{}
+            , connections_{}
+            , intervalEnd_{}
+            , minDelay_(std::numeric_limits<unsigned long long>::max())
+            , shedding_{}
+            , waiting_{}
+        {
+        }
+
+        // A request's body is complete and its handler queued.
+        void HandlerQueued()
+        {
+            if (config_.shedTarget > 0)
+                waiting_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // The handler of a request queued at Metrics::Now `readyNs` starts.
+        void HandlerStarted(unsigned long long readyNs)
+        {
+            if (config_.shedTarget == 0)
+                return;
+
+            waiting_.fetch_sub(1, std::memory_order_relaxed);
+            unsigned long long now = Metrics::Now();
+            unsigned long long delayNs = now - readyNs;
+            unsigned long long current = minDelay_.load(std::memory_order_relaxed);
+            while (delayNs < current && !minDelay_.compare_exchange_weak(current, delayNs, std::memory_order_relaxed))
+            {
+            }
+            EndInterval(now);
+        }
+
+        // Whether new requests are being shed; checked per BEGIN_REQUEST.
+        // Once the queue has drained, requests are let in again and the
+        // next judgement takes a fresh interval.
+        bool Shedding()
+        {
+            if (config_.shedTarget == 0)
+                return false;
+
+            unsigned long long now = Metrics::Now();
+            EndInterval(now);
+            if (!shedding_.load(std::memory_order_relaxed))
+                return false;
+            if (waiting_.load(std::memory_order_relaxed) > 0)
+                return true;
+
+            if (shedding_.exchange(false, std::memory_order_relaxed))
+            {
+                minDelay_.store(std::numeric_limits<unsigned long long>::max(), std::memory_order_relaxed);
+                intervalEnd_.store(now + config_.shedInterval * 1000000ull, std::memory_order_relaxed);
+                LogOutput(LogInfo) << "queue drained, admitting requests again";
+            }
+            return false;
+        }
+
+        bool TryConnect()
+        {
+            unsigned int current = connections_.load(std::memory_order_relaxed);
+            do
+            {
+                if (current >= config_.maxConnections)
+                    return false;
+            } while (!connections_.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+            return true;
+        }
+
+        void Disconnect()
+        {
+            connections_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        unsigned int Connections() const
+        {
+            return connections_.load(std::memory_order_relaxed);
+        }
+
+        bool TryAdmit()
+        {
+            if (queuedBytes_.load(std::memory_order_relaxed) >= (long long)config_.maxQueuedBytes)
+                return false;
+
+            unsigned int current = requests_.load(std::memory_order_relaxed);
+            do
+            {
+                if (current >= config_.maxRequests)
+                    return false;
+            } while (!requests_.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+            return true;
+        }
+
+        void Leave()
+        {
+            requests_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        void AddQueuedBytes(long long delta)
+        {
+            if (delta != 0)
+                queuedBytes_.fetch_add(delta, std::memory_order_relaxed);
+        }
+
+        unsigned int Requests() const { return requests_.load(std::memory_order_relaxed); }
+        long long QueuedBytes() const { return queuedBytes_.load(std::memory_order_relaxed); }
+    };
+
+    // Handlers waiting to run on one io_service, a FIFO per priority class.
+    // Every queued task posts a token and every token runs the most urgent
+    // task left, so the class decides the order and asio picks the thread.
+    // A task that has to wait behind others also sends a token to a sibling
+    // queue; if the sibling's threads get to it first, they run the task.
+    class HandlerQueue
+    {
+        struct Task
+        {
+            std::function<void()> run;
+            unsigned long long queuedNs;
+        };
+
+        asio::io_service& io_service_;
+        const ServerConfig& config_;
+
+        std::mutex mutex_;
+        std::deque<Task> queues_[PriorityCount];
+        unsigned int waiting_;
+        unsigned int picks_;
+
+        std::vector<HandlerQueue*> siblings_;
+        unsigned int nextSibling_;
+
+        bool Pop(Task& task)
+        {
+            if (waiting_ == 0)
+                return false;
+
+            bool lowest = config_.lowPriorityShare > 0 && ++picks_ % config_.lowPriorityShare == 0;
+            for (int i = 0; i < PriorityCount; ++i)
+            {
+                std::deque<Task>& queue = queues_[lowest ? PriorityCount - 1 - i : i];
+                if (!queue.empty())
+                {
+                    task = std::move(queue.front());
+                    queue.pop_front();
+                    --waiting_;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Runs the most urgent task still waiting; tokens outnumber tasks
+        // once siblings have taken some, so finding none is normal.
+        void RunNext()
+        {
+            Task task;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!Pop(task))
+                    return;
+            }
+            Metrics::Record(Metrics::HandlerQueueWait, Metrics::Now() - task.queuedNs);
+            task.run();
+        }
+
+    public:
+        HandlerQueue(asio::io_service& io_service, const ServerConfig& config)
+            : io_service_(io_service)
+            , config_(config)
+            , waiting_{}
+            , picks_{}
+            , nextSibling_{}
+        {
+        }
+
+        asio::io_service& IoService()
+        {
+            return io_service_;
+        }
+
+        // Queues whose threads may run this queue's backlog. Set before
+        // anything is posted.
+        void SetSiblings(std::vector<HandlerQueue*> siblings)
+        {
+            siblings_ = std::move(siblings);
+        }
+
+        void Post(HandlerPriority priority, std::function<void()> run)
+        {
+            HandlerQueue* helper = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queues_[priority].push_back(Task{ std::move(run), Metrics::Now() });
+                if (++waiting_ > 1 && !siblings_.empty())
+                    helper = siblings_[nextSibling_++ % siblings_.size()];
+            }
+
+            asio::post(io_service_, [this]() {
+                RunNext();
+            });
+            if (helper)
+            {
+                asio::post(helper->io_service_, [this]() {
+                    RunNext();
+                });
+            }
+        }
+    };
+
+    // State shared by every connection of the process.
+    struct ServerContext
+    {
+        const ServerConfig& config;
+        const Router& router;
+        AdmissionControl admission;
+
+        // Queue of the pool that runs request handlers; null to run them on
+        // the connection's shard.
+        HandlerQueue* handlerQueue;
+
+        // Null unless cacheTtl is set.
+        std::unique_ptr<ResponseCache> cache;
+
+        // Set once the server stops accepting; connections close as soon
+        // as nothing is in progress on them.
+        std::atomic<bool> draining;
+
+        ServerContext(const ServerConfig& config, const Router& router)
+            : config(config)
+            , router(router)
+            , admission(config)
+            , handlerQueue{}
+            , cache(config.cacheTtl > 0 ? new ResponseCache(config) : nullptr)
+            , draining{}
+        {
+        }
     };
 
-    class Worker
+    class Worker : public IRequest, public IResponse
     {
         asio::io_service& io_service_;
+        ServerContext& context_;
+        const ServerConfig& config_;
         IRecordSender* sender_;
+        OutputQueue output_;
 
-        std::unordered_map<std::string, std::string> params_;
-        asio::streambuf stdin_buf_;
+        ParamStore params_;
+        RequestBody body_;
+        std::shared_ptr<BodyStream> stream_;
 
         int reqId_;
 
         bool requestRunning_;
         bool closeOnComplete_;
 
-        void ResetBuffer()
+        // Set while the application runs on the handler pool; the reading
+        // coroutine must not touch the request's buffers in the meantime.
+        bool handling_;
+
+        // Set on the connection when a running handler is to give up, and
+        // read by the handler; timedOut_ is written before it.
+        std::atomic<bool> cancelled_;
+        bool timedOut_;
+
+        // Whether part of the response has gone to the connection already.
+        bool submitted_;
+
+        // Whether this request holds a slot in the AdmissionControl, and how
+        // many buffered body bytes it has charged to it.
+        bool admitted_;
+        long long stdinBytes_;
+
+        // Handler chosen by the router once PARAMS are complete, and the
+        // response state it builds up.
+        IHandler* handler_;
+        std::string headers_;
+        bool headersSent_;
+        bool stderrUsed_;
+        unsigned int appStatus_;
+
+        // Metrics::Now at BEGIN_REQUEST, and time spent decoding PARAMS.
+        unsigned long long beginNs_;
+        unsigned long long paramsNs_;
+
+        // Metrics::Now when the body was complete and the handler queued.
+        unsigned long long readyNs_;
+
+        // Response cache key of a cacheable request, and whether this request
+        // computes the response for it. cacheable_ is cleared by response
+        // headers that rule out caching; cached_ is the response a waiting
+        // request was handed.
+        std::string cacheKey_;
+        bool cacheLeader_;
+        bool cacheable_;
+        ResponseCache::Response cached_;
+
+        void ReleaseAdmission()
+        {
+            if (admitted_)
+            {
+                context_.admission.Leave();
+                admitted_ = false;
+                Metrics::Add(Metrics::RequestsFinished);
+                Metrics::Record(Metrics::RequestTime, Metrics::Now() - beginNs_);
+            }
+            context_.admission.AddQueuedBytes(-stdinBytes_);
+            stdinBytes_ = 0;
+        }
+
+        void ResetBuffer()
+        {
+            ReleaseAdmission();
+            params_.Clear();
+            body_.Clear();
+            stream_.reset();
+            handler_ = nullptr;
+            headers_.clear();
+            headersSent_ = false;
+            stderrUsed_ = false;
+            appStatus_ = 0;
+            cancelled_.store(false, std::memory_order_relaxed);
+            timedOut_ = false;
+            submitted_ = false;
+            cacheKey_.clear();
+            cacheLeader_ = false;
+            cacheable_ = true;
+            cached_.reset();
+        }
+
+        // Answers a BEGIN_REQUEST that will not be served; the Worker stays idle.
+        bool RejectRequest(unsigned char protocolStatus)
+        {
+            Metrics::Add(Metrics::RequestsRejected);
+            if (protocolStatus == FCGI_OVERLOADED && !config_.overloadResponse.empty())
+            {
+                QueueStatusResponse("503 Service Unavailable", config_.overloadResponse);
+                protocolStatus = FCGI_REQUEST_COMPLETE;
+            }
+            SendEndRequest(0, protocolStatus);
+            Flush();
+            return true;
+        }
+
+        bool OnBeginRequest(const RecordView& record)
+        {
+            ResetBuffer();
+            reqId_ = record.header.RequestId();
+
+            if (record.header.ContentLength() < sizeof(FCGI_BeginRequestBody))
+                return false;
+
+            const FCGI_BeginRequestBody* br = (const FCGI_BeginRequestBody*)record.content;
+
+            // Set before anything can reject the request, so a refusal closes
+            // the connection the same way a response does.
+            closeOnComplete_ = !(br->flags & FCGI_KEEP_CONN);
+
+            unsigned short role = (br->roleB1 << 8) | br->roleB0;
+            if (role != FCGI_RESPONDER)
+                return RejectRequest(FCGI_UNKNOWN_ROLE);
+
+            if (!config_.multiplex && sender_->ActiveRequests() > 0)
+                return RejectRequest(FCGI_CANT_MPX_CONN);
+
+            if (context_.admission.Shedding())
+            {
+                Metrics::Add(Metrics::RequestsShed);
+                return RejectRequest(FCGI_OVERLOADED);
+            }
+
+            if (!context_.admission.TryAdmit())
+                return RejectRequest(FCGI_OVERLOADED);
+
+            admitted_ = true;
+            requestRunning_ = true;
+            beginNs_ = Metrics::Now();
+            paramsNs_ = 0;
+            Metrics::Add(Metrics::RequestsStarted);
+
+            return true;
+        }
+
+        bool OnParam(const RecordView& record)
+        {
+            int len = record.header.ContentLength();
+
+            // The empty record ends the stream; a pair cut short there is malformed.
+            if (len == 0)
+            {
+                if (!params_.Complete())
+                    return false;
+
+                Metrics::Record(Metrics::ParamsDecode, paramsNs_);
+                handler_ = context_.router.Find(Path());
+                if (handler_)
+                {
+                    std::unique_ptr<IBodyConsumer> consumer = handler_->OpenBodyStream(*this);
+                    if (consumer)
+                        stream_ = std::make_shared<BodyStream>(sender_->HandlerService(), std::move(consumer));
+                }
+                return true;
+            }
+
+            unsigned long long start = Metrics::Now();
+            bool result = params_.Append(record.content, len);
+            paramsNs_ += Metrics::Now() - start;
+            return result;
+        }
+
+        bool OnAbortRequest(const RecordView& record)
+        {
+            Cancel(false);
+            return true;
+        }
+
+        bool OnGetValues(const RecordView& record)
+        {
+            const char* beginPtr = record.content;
+            const char* endPtr = record.content + record.header.ContentLength();
+            std::string result;
+
+            while (beginPtr < endPtr)
+            {
+                unsigned int nameLen, valueLen;
+                const char* namePtr = ReadKeyValueLengths(beginPtr, endPtr, nameLen, valueLen);
+                if (!namePtr)
+                    return false;
+                beginPtr = namePtr + nameLen + valueLen;
+
+                std::string_view name(namePtr, nameLen);
+                if (name == FCGI_MAX_CONNS)
+                    AppendKeyValuePair(result, name, std::to_string(config_.maxConnections));
+                else if (name == FCGI_MAX_REQS)
+                    AppendKeyValuePair(result, name, std::to_string(config_.maxRequests));
+                else if (name == FCGI_MPXS_CONNS)
+                    AppendKeyValuePair(result, name, config_.multiplex ? "1" : "0");
+            }
+
+            if (result.size() > ushort_max)
+                return false;
+
+            RecordBuf* reply = RecordBuf::Create(FCGI_NULL_REQUEST_ID, FCGI_GET_VALUES_RESULT, (int)result.size());
+            memcpy(reply->content, result.data(), result.size());
+            output_.Push(RecordBufPtr(reply));
+            Flush();
+            return true;
+        }
+
+        bool OnUnknownManagementRecord(const RecordView& record)
+        {
+            RecordBuf* reply = RecordBuf::Create(FCGI_NULL_REQUEST_ID, FCGI_UNKNOWN_TYPE, sizeof(FCGI_UnknownTypeBody));
+            FCGI_UnknownTypeBody* body = (FCGI_UnknownTypeBody*)reply->content;
+            memset(body, 0, sizeof(*body));
+            body->type = record.header.type;
+            output_.Push(RecordBufPtr(reply));
+            Flush();
+            return true;
+        }
+
+        bool OnStdinData(const RecordView& record)
+        {
+            int contentLen = record.header.ContentLength();
+            if (contentLen > 0)
+            {
+                if (stream_)
+                {
+                    RecordBufPtr chunk(RecordBuf::Create(reqId_, FCGI_STDIN, contentLen));
+                    memcpy(chunk->content, record.content, contentLen);
+                    sender_->StreamBody(stream_, std::move(chunk));
+                    return true;
+                }
+
+                long long before = body_.MemoryBytes();
+                if (!body_.Append(record.content, contentLen, config_.bodyMemoryLimit, config_.tempDir))
+                {
+                    LogOutput(LogError) << "ReqId:" << reqId_ << " fail to spill request body to " << config_.tempDir << " - " << strerror(errno);
+                    return false;
+                }
+
+                long long delta = (long long)body_.MemoryBytes() - before;
+                stdinBytes_ += delta;
+                context_.admission.AddQueuedBytes(delta);
+                return true;
+            }
+            else
+            {
+                return OnStdinComplete();
+            }
+        }
+
+        bool OnStdinComplete()
+        {
+            handling_ = true;
+            readyNs_ = Metrics::Now();
+            if (context_.cache && LookupCache())
+                return true;
+            context_.admission.HandlerQueued();
+
+            if (stream_)
+            {
+                std::shared_ptr<BodyStream> stream = stream_;
+                sender_->Execute(reqId_, [this, stream]() {
+                    stream->consumer->OnBodyEnd();
+                    RunHandler();
+                }, PriorityNormal, &stream->strand);
+            }
+            else
+            {
+                // An unrouted request only gets a short 404.
+                HandlerPriority priority = handler_ ? handler_->Priority(*this) : PriorityHigh;
+                if (body_.Size() >= config_.bulkRequestBytes)
+                    priority = PriorityBulk;
+                sender_->Execute(reqId_, [this]() { RunHandler(); }, priority);
+            }
+            return true;
+        }
+
+        // Answers a cacheable request from the cache where possible, on the
+        // connection. Returns true if the request has been taken care of:
+        // answered on the spot, or left waiting for the request that is
+        // computing the same response. Otherwise the handler is to run, and
+        // if this is the first request for the key it will fill the cache.
+        bool LookupCache()
+        {
+            std::string_view method = params_.Get(ParamRequestMethod);
+            if (stream_ || !handler_ || body_.Size() > 0 || (method != "GET" && method != "HEAD") || !handler_->Cacheable(*this))
+                return false;
+
+            ResponseCache& cache = *context_.cache;
+            cache.MakeKey(params_, cacheKey_);
+            ResponseCache::Response response;
+            switch (cache.Lookup(cacheKey_, response))
+            {
+            case ResponseCache::Hit:
+                Metrics::Add(Metrics::CacheHits);
+                handling_ = false;
+                PushCached(response);
+                Flush();
+                ReleaseAdmission();
+                requestRunning_ = false;
+                return true;
+
+            case ResponseCache::Miss:
+                Metrics::Add(Metrics::CacheMisses);
+                cacheLeader_ = true;
+                return false;
+
+            case ResponseCache::Pending:
+                break;
+            }
+
+            Metrics::Add(Metrics::CacheCoalesced);
+            context_.admission.HandlerQueued();
+            std::function<void()> start = sender_->Defer(reqId_, [this]() { RunCached(); }, PriorityHigh);
+            cache.Wait(cacheKey_, [this, start](const ResponseCache::Response& response) {
+                cached_ = response;
+                start();
+            });
+            return true;
+        }
+
+        // Queues a cached response, which is framed for request id 1.
+        void PushCached(const ResponseCache::Response& response)
+        {
+            if (reqId_ == 1)
+                output_.Push(response);
+            else
+                output_.Push(std::make_shared<const std::string>(ResponseCache::Reframe(*response, reqId_)));
+        }
+
+        // Runs on the handler pool for a request that waited on another one
+        // with the same cache key. If that response was not cached, this
+        // request runs its own handler.
+        void RunCached()
+        {
+            if (!cached_)
+            {
+                RunHandler();
+                return;
+            }
+
+            context_.admission.HandlerStarted(readyNs_);
+            if (Cancelled())
+                EndCancelled();
+            else
+                PushCached(cached_);
+            cached_.reset();
+        }
+
+        // Runs on the handler pool; only touches this request's own state.
+        void RunHandler()
+        {
+            context_.admission.HandlerStarted(readyNs_);
+
+            // A request abandoned while queued for the pool is not started.
+            if (!Cancelled())
+            {
+                if (handler_)
+                {
+                    handler_->Handle(*this, *this);
+                }
+                else
+                {
+                    Header("Status", "404 Not Found");
+                    Header("Content-type", "text/plain");
+                    Write("not found\n");
+                }
+            }
+
+            if (Cancelled())
+            {
+                EndCancelled();
+                if (cacheLeader_)
+                    context_.cache->Complete(cacheKey_, nullptr);
+                return;
+            }
+
+            SendHeaders();
+            SendStdout(0, 0);
+            if (stderrUsed_)
+                output_.Push(reqId_, FCGI_STDERR, nullptr, 0);
+            SendEndRequest(appStatus_, FCGI_REQUEST_COMPLETE);
+            if (cacheLeader_)
+                context_.cache->Complete(cacheKey_, CacheableResponse());
+        }
+
+        // Ends a cancelled request; whatever the handler left unsent is dropped.
+        void EndCancelled()
+        {
+            output_.Clear();
+            if (timedOut_ && !submitted_)
+                QueueStatusResponse("504 Gateway Timeout", "request timed out\n");
+            SendEndRequest(appStatus_, FCGI_REQUEST_COMPLETE);
+        }
+
+        // The finished response as the cache keeps it, or null if it may not
+        // be cached or has partly gone out already.
+        ResponseCache::Response CacheableResponse() const
+        {
+            if (!cacheable_ || submitted_ || stderrUsed_ || appStatus_ != 0)
+                return nullptr;
+
+            std::string records;
+            if (!output_.Serialize(records))
+                return nullptr;
+            if (reqId_ != 1)
+                records = ResponseCache::Reframe(records, 1);
+            return std::make_shared<const std::string>(std::move(records));
+        }
+
+        // Clears cacheable_ for response headers that rule out caching.
+        void CheckCacheHeader(std::string_view name, std::string_view value)
+        {
+            auto is = [name](const char* header) {
+                return name.size() == strlen(header) && strncasecmp(name.data(), header, name.size()) == 0;
+            };
+
+            if (is("Status"))
+            {
+                if (value.substr(0, 3) != "200")
+                    cacheable_ = false;
+            }
+            else if (is("Set-Cookie"))
+            {
+                cacheable_ = false;
+            }
+            else if (is("Cache-Control"))
+            {
+                std::string directives(value);
+                std::transform(directives.begin(), directives.end(), directives.begin(), [](unsigned char c) { return (char)tolower(c); });
+                if (directives.find("no-store") != std::string::npos || directives.find("no-cache") != std::string::npos || directives.find("private") != std::string::npos)
+                    cacheable_ = false;
+            }
+        }
+
+        void SendHeaders()
+        {
+            if (headersSent_)
+                return;
+            headersSent_ = true;
+            headers_ += "\r\n";
+            SendStdout(std::move(headers_));
+            headers_.clear();
+        }
+
+        // Queues a complete plain-text response, STDOUT terminator included.
+        void QueueStatusResponse(const char* status, const std::string& body)
+        {
+            std::string response = "Status: ";
+            response += status;
+            response += "\r\nContent-type: text/plain\r\n\r\n";
+            response += body;
+            output_.Push(reqId_, FCGI_STDOUT, std::move(response));
+            output_.Push(reqId_, FCGI_STDOUT, nullptr, 0);
+        }
+
+        // Hands everything queued so far to the connection; a cancelled
+        // handler's output is thrown away instead.
+        void Flush()
+        {
+            if (handling_ && Cancelled())
+            {
+                output_.Clear();
+                return;
+            }
+
+            if (!output_.Empty())
+            {
+                submitted_ = true;
+                sender_->Submit(std::move(output_));
+                output_.Clear();
+            }
+        }
+
+        // `data` is referenced until written, so it must not be stack or
+        // request-local memory; pass a std::string to hand over ownership.
+        bool SendStdout(const char* data, int len)
+        {
+            while (len > 0 || data == 0)
+            {
+                int curlen = std::min<int>(len, ushort_max);
+                output_.Push(reqId_, FCGI_STDOUT, data, curlen);
+
+                if (data == 0)
+                    break;
+
+                len -= curlen;
+                data += curlen;
+            }
+
+            if (output_.QueuedBytes() >= config_.outputHighWater)
+                Flush();
+            return true;
+        }
+
+        bool SendStdout(std::string&& data)
+        {
+            output_.Push(reqId_, FCGI_STDOUT, std::move(data));
+            if (output_.QueuedBytes() >= config_.outputHighWater)
+                Flush();
+            return true;
+        }
+
+        bool SendEndRequest(unsigned int exitcode, unsigned int statuscode)
+        {
+            RecordBuf* record = RecordBuf::Create(reqId_, FCGI_END_REQUEST, sizeof(FCGI_EndRequestBody));
+
+            FCGI_EndRequestBody* body = (FCGI_EndRequestBody*)record->content;
+            memset(body, 0, sizeof(*body));
+            body->protocolStatus = statuscode;
+            body->appStatusB3 = exitcode >> 24;
+            body->appStatusB2 = (exitcode >> 16) & 0xff;
+            body->appStatusB1 = (exitcode >> 8) & 0xff;
+            body->appStatusB0 = exitcode & 0xff;
+
+            output_.Push(RecordBufPtr(record));
+            return true;
+        }
+
+    public:
+        const ParamStore& Params() const override
+        {
+            return params_;
+        }
+
+        std::string_view Path() const override
+        {
+            std::string_view uri = params_.Get(ParamDocumentUri);
+            return uri.empty() ? params_.Get(ParamScriptName) : uri;
+        }
+
+        std::size_t ReadBody(char* buf, std::size_t len) override
+        {
+            return body_.Read(buf, len);
+        }
+
+        unsigned long long BodySize() const override
+        {
+            return body_.Size();
+        }
+
+        IBodyConsumer* BodyConsumer() const override
+        {
+            return stream_ ? stream_->consumer.get() : nullptr;
+        }
+
+        bool Cancelled() const override
+        {
+            return cancelled_.load(std::memory_order_acquire);
+        }
+
+        void Header(std::string_view name, std::string_view value) override
+        {
+            if (cacheLeader_)
+                CheckCacheHeader(name, value);
+            headers_.append(name.data(), name.size());
+            headers_ += ": ";
+            headers_.append(value.data(), value.size());
+            headers_ += "\r\n";
+        }
+
+        using IResponse::Write;
+
+        void Write(std::string&& data) override
+        {
+            SendHeaders();
+            SendStdout(std::move(data));
+        }
+
+        void Write(std::string_view data) override
+        {
+            Write(std::string(data));
+        }
+
+        void Error(std::string_view text) override
+        {
+            if (text.empty())
+                return;
+            stderrUsed_ = true;
+            output_.Push(reqId_, FCGI_STDERR, std::string(text));
+        }
+
+        void Exit(unsigned int status) override
+        {
+            appStatus_ = status;
+        }
+
+        // Sends [offset, offset + length) of `fd` as STDOUT. The payload goes
+        // from the page cache to the socket with sendfile(2) and is never
+        // copied through user space. The descriptor is duplicated, so the
+        // caller keeps its own; the file must not shrink until it is sent.
+        bool SendFile(int fd, unsigned long long offset, unsigned long long length) override
+        {
+            SendHeaders();
+            int dupFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            if (dupFd < 0)
+            {
+                LogOutput(LogError) << "ReqId:" << reqId_ << " fail to duplicate file descriptor - " << strerror(errno);
+                return false;
+            }
+
+            output_.Push(reqId_, FCGI_STDOUT, std::make_shared<OutputQueue::FileSource>(dupFd), offset, length);
+            if (output_.QueuedBytes() >= config_.outputHighWater)
+                Flush();
+            return true;
+        }
+
+        Worker(asio::io_service& io_service, ServerContext& context, IRecordSender* sender)
+            : io_service_(io_service)
+            , context_(context)
+            , config_(context.config)
+            , sender_(sender)
+            , requestRunning_{}
+            , closeOnComplete_{}
+            , handling_{}
+            , cancelled_{}
+            , timedOut_{}
+            , submitted_{}
+            , admitted_{}
+            , stdinBytes_{}
+            , handler_{}
+            , headersSent_{}
+            , stderrUsed_{}
+            , appStatus_{}
+            , beginNs_{}
+            , paramsNs_{}
+            , readyNs_{}
+            , cacheLeader_{}
+            , cacheable_(true)
+        {
+        }
+
+        ~Worker()
+        {
+            ReleaseAdmission();
+        }
+
+        bool Running() const
+        {
+            return requestRunning_;
+        }
+
+        // Whether the last BEGIN_REQUEST had FCGI_KEEP_CONN clear, so the
+        // connection is closed once the request has been answered.
+        bool CloseOnComplete() const
+        {
+            return closeOnComplete_;
+        }
+
+        unsigned long long BeginNs() const
+        {
+            return beginNs_;
+        }
+
+        // Abandons the request on the connection's behalf. A running handler
+        // is told through Cancelled() and the request ends when it returns;
+        // otherwise the buffers go and END_REQUEST is sent right away, and
+        // the result is true. `timedOut` answers with 504 if nothing has
+        // been sent yet.
+        bool Cancel(bool timedOut)
+        {
+            if (!requestRunning_ || Cancelled())
+                return false;
+
+            Metrics::Add(Metrics::RequestsCancelled);
+            if (handling_)
+            {
+                timedOut_ = timedOut;
+                cancelled_.store(true, std::memory_order_release);
+                return false;
+            }
+
+            ResetBuffer();
+            requestRunning_ = false;
+            if (timedOut)
+                QueueStatusResponse("504 Gateway Timeout", "request timed out\n");
+            SendEndRequest(0, FCGI_REQUEST_COMPLETE);
+            Flush();
+            return true;
+        }
+
+        // Called on the connection once the handler has returned. The tail of
+        // the response (END_REQUEST included) is handed over in the same step
+        // that ends the request, so the peer cannot start the next request on
+        // this id before the Worker is free again.
+        void Finish(OutputQueue& connectionOutput)
+        {
+            connectionOutput.Append(std::move(output_));
+            output_.Clear();
+            ReleaseAdmission();
+            handling_ = false;
+            requestRunning_ = false;
+        }
+
+        bool FeedPacket(const RecordView& record)
+        {
+            bool result = true;
+
+            bool notProcessed = false;
+
+            if (handling_)
+            {
+                // Everything but ABORT_REQUEST after the STDIN terminator is a
+                // protocol error, and the handler still owns the buffers.
+                if (record.header.type == FCGI_ABORT_REQUEST)
+                    result = OnAbortRequest(record);
+                else
+                    notProcessed = true;
+            }
+            else if (!requestRunning_)
+            {
+                switch (record.header.type)
+                {
+                case FCGI_BEGIN_REQUEST:
+                    result = OnBeginRequest(record);
+                    break;
+                case FCGI_GET_VALUES:
+                    result = OnGetValues(record);
+                    break;
+                case FCGI_PARAMS:
+                case FCGI_STDIN:
+                case FCGI_ABORT_REQUEST:
+                    // Stream records of a request that was turned away or
+                    // already ended; the peer may have sent them before it
+                    // saw our END_REQUEST.
+                    break;
+                default:
+                    if (record.header.RequestId() == FCGI_NULL_REQUEST_ID)
+                        result = OnUnknownManagementRecord(record);
+                    else
+                        notProcessed = true;
+                    break;
+                }
+            }
+            else
+            {
+                switch (record.header.type)
+                {
+                case FCGI_PARAMS:
+                    result = OnParam(record);
+                    break;
+
+                case FCGI_STDIN:
+                    result = OnStdinData(record);
+                    break;
+
+                case FCGI_ABORT_REQUEST:
+                    result = OnAbortRequest(record);
+                    break;
+
+                default:
+                    notProcessed = true;
+                    break;
+                }
+            }
+
+            if (notProcessed)
+            {
+                LogOutput(LogWarning) << "ReqId:" << record.header.RequestId() << " Unsupported type " << (int)record.header.type;
+
+                result = true;
+            }
+
+            return result;
+        }
+    };
+
+    // Request id -> Worker map for one connection. nginx only ever uses request
+    // id 1, so the first live request sits in an inline slot; multiplexed
+    // requests spill into a small open-addressed table that grows on demand.
+    // Finished Workers are kept as a spare and reused by the next request.
+    class RequestTable
+    {
+        struct Slot
+        {
+            unsigned short id;
+            std::unique_ptr<Worker> worker;
+        };
+
+        Slot inline_;
+        std::vector<Slot> slots_;
+        unsigned int spilled_;
+        std::unique_ptr<Worker> spare_;
+
+        unsigned int Mask() const
+        {
+            return (unsigned int)slots_.size() - 1;
+        }
+
+        static unsigned int Hash(unsigned short id)
+        {
+            return id * 0x9e3779b1u >> 16;
+        }
+
+        Slot* FindSpilled(unsigned short id)
+        {
+            if (spilled_ == 0)
+                return nullptr;
+            for (unsigned int i = Hash(id) & Mask();; i = (i + 1) & Mask())
+            {
+                if (!slots_[i].worker)
+                    return nullptr;
+                if (slots_[i].id == id)
+                    return &slots_[i];
+            }
+        }
+
+        void InsertSpilled(unsigned short id, std::unique_ptr<Worker> worker)
+        {
+            if ((spilled_ + 1) * 4 > slots_.size() * 3)
+                Grow();
+            unsigned int i = Hash(id) & Mask();
+            while (slots_[i].worker)
+                i = (i + 1) & Mask();
+            slots_[i].id = id;
+            slots_[i].worker = std::move(worker);
+            ++spilled_;
+        }
+
+        void Grow()
+        {
+            std::vector<Slot> old;
+            old.swap(slots_);
+            slots_.resize(old.empty() ? 8 : old.size() * 2);
+            spilled_ = 0;
+            for (auto& slot : old)
+            {
+                if (slot.worker)
+                    InsertSpilled(slot.id, std::move(slot.worker));
+            }
+        }
+
+        // Backward-shift deletion keeps probe chains intact without tombstones.
+        std::unique_ptr<Worker> EraseSpilled(Slot* slot)
+        {
+            std::unique_ptr<Worker> result = std::move(slot->worker);
+            unsigned int hole = (unsigned int)(slot - slots_.data());
+            for (unsigned int i = (hole + 1) & Mask(); slots_[i].worker; i = (i + 1) & Mask())
+            {
+                unsigned int home = Hash(slots_[i].id) & Mask();
+                if (((i - home) & Mask()) >= ((i - hole) & Mask()))
+                {
+                    slots_[hole] = std::move(slots_[i]);
+                    hole = i;
+                }
+            }
+            --spilled_;
+            return result;
+        }
+
+    public:
+        RequestTable()
+            : inline_{}
+            , spilled_{}
+        {
+        }
+
+        Worker* Find(unsigned short id)
+        {
+            if (inline_.worker && inline_.id == id)
+                return inline_.worker.get();
+            Slot* slot = FindSpilled(id);
+            return slot ? slot->worker.get() : nullptr;
+        }
+
+        template<class Factory>
+        Worker* Acquire(unsigned short id, Factory&& factory)
+        {
+            Worker* worker = Find(id);
+            if (worker)
+                return worker;
+
+            std::unique_ptr<Worker> fresh = spare_ ? std::move(spare_) : factory();
+            worker = fresh.get();
+            if (!inline_.worker)
+            {
+                inline_.id = id;
+                inline_.worker = std::move(fresh);
+            }
+            else
+            {
+                InsertSpilled(id, std::move(fresh));
+            }
+            return worker;
+        }
+
+        // Removes the Worker for `id`; it is kept for reuse unless `discard` is set.
+        void Release(unsigned short id, bool discard = false)
+        {
+            std::unique_ptr<Worker> worker;
+            if (inline_.worker && inline_.id == id)
+            {
+                worker = std::move(inline_.worker);
+            }
+            else
+            {
+                Slot* slot = FindSpilled(id);
+                if (!slot)
+                    return;
+                worker = EraseSpilled(slot);
+            }
+
+            if (!discard && !spare_)
+                spare_ = std::move(worker);
+        }
+
+        unsigned int Size() const
+        {
+            return (inline_.worker ? 1 : 0) + spilled_;
+        }
+
+        template<class Function>
+        void ForEach(Function&& function)
+        {
+            if (inline_.worker)
+                function(inline_.id, *inline_.worker);
+            for (auto& slot : slots_)
+            {
+                if (slot.worker)
+                    function(slot.id, *slot.worker);
+            }
+        }
+
+        // Drops the spare Worker and, if nothing has spilled, the table.
+        void Trim()
+        {
+            spare_.reset();
+            if (spilled_ == 0)
+                std::vector<Slot>().swap(slots_);
+        }
+    };
+
+    // An operation queued on a UringLoop. Complete runs on the thread that
+    // reaps the completion, once per completion the operation posts.
+    class UringOp
+    {
+    public:
+        virtual ~UringOp()
+        {
+        }
+
+        virtual void Complete(int result, unsigned int flags) = 0;
+    };
+
+    // One io_uring per shard. The shard's io_service waits on the ring's
+    // eventfd, so completions are reaped by the threads running the shard.
+    class UringLoop
+    {
+        UringQueue queue_;
+        asio::posix::stream_descriptor event_;
+
+        // Submissions and recycled buffers come from every thread of the shard.
+        std::mutex mutex_;
+        unsigned int recycled_;
+        unsigned int recycleBatch_;
+
+        static unsigned long long Tag(UringOp* op)
+        {
+            return (unsigned long long)(uintptr_t)op;
+        }
+
+        void WaitCompletions()
+        {
+            event_.async_wait(asio::posix::stream_descriptor::wait_read, [this](const error_code& ec) {
+                if (ec != errc::success)
+                {
+                    LogOutput(LogError) << "fail to wait for io_uring completions : " << ec.message();
+                    return;
+                }
+
+                unsigned long long signalled;
+                if (read(event_.native_handle(), &signalled, sizeof(signalled)) < 0 && errno != EAGAIN)
+                    LogOutput(LogWarning) << "fail to read io_uring eventfd : " << strerror(errno);
+
+                UringQueue::Completion batch[64];
+                unsigned int count;
+                while ((count = queue_.Reap(batch, 64)) > 0)
+                {
+                    for (unsigned int i = 0; i < count; ++i)
+                    {
+                        if (batch[i].userData)
+                            ((UringOp*)(uintptr_t)batch[i].userData)->Complete(batch[i].result, batch[i].flags);
+                    }
+                }
+                WaitCompletions();
+            });
+
+            // A completion posted after the last reap but before the wait was
+            // queued may have signalled nobody; signal again so it is seen.
+            if (queue_.Ready())
+            {
+                unsigned long long one = 1;
+                if (write(event_.native_handle(), &one, sizeof(one)) < 0)
+                    LogOutput(LogWarning) << "fail to signal io_uring eventfd : " << strerror(errno);
+            }
+        }
+
+        bool Submit()
+        {
+            recycled_ = 0;
+            if (!queue_.Submit())
+            {
+                LogOutput(LogError) << "fail to submit to io_uring : " << strerror(errno);
+                return false;
+            }
+            return true;
+        }
+
+    public:
+        UringLoop(asio::io_service& io_service)
+            : event_(io_service)
+            , recycled_{}
+            , recycleBatch_{}
+        {
+        }
+
+        bool Init(const ServerConfig& config)
+        {
+            std::string error;
+            if (!queue_.Init(4096, config.uringBuffers, config.uringBufferSize, error))
+            {
+                LogOutput(LogError) << "fail to set up io_uring : " << error;
+                return false;
+            }
+            recycleBatch_ = std::max(1u, config.uringBuffers / 4);
+
+            error_code ec;
+            event_.assign(dup(queue_.EventFd()), ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogError) << "fail to watch io_uring eventfd : " << ec.message();
+                return false;
+            }
+            WaitCompletions();
+            return true;
+        }
+
+        bool Accept(int fd, UringOp* op)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return queue_.Accept(fd, Tag(op)) && Submit();
+        }
+
+        bool Recv(int fd, UringOp* op)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return queue_.Recv(fd, Tag(op)) && Submit();
+        }
+
+        // Queues the messages as one linked chain; `op` completes once per message.
+        bool Send(int fd, const std::vector<msghdr>& messages, UringOp* op)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.Space() < messages.size() && !Submit())
+                return false;
+            for (std::size_t i = 0; i < messages.size(); ++i)
+            {
+                if (!queue_.SendMsg(fd, &messages[i], i + 1 < messages.size(), Tag(op)))
+                    return false;
+            }
+            return Submit();
+        }
+
+        void Cancel(UringOp* op)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.Cancel(Tag(op)))
+                Submit();
+        }
+
+        const char* Buffer(int id) const
+        {
+            return queue_.Buffer(id);
+        }
+
+        // Recycled buffers reach the kernel with the next submission, which
+        // is usually a response going out; a quarter of the pool waiting
+        // forces one, so receives do not run dry while nothing is sent.
+        void RecycleBuffer(int id)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.RecycleBuffer(id);
+            if (++recycled_ >= recycleBatch_)
+                Submit();
+        }
+    };
+
+    // A shard as seen by an acceptor handing it connections.
+    class ProtocolClient;
+
+    // The admitted connections of one shard, so that a drain can reach the
+    // idle ones rather than wait for their watchdogs.
+    class ConnectionSet
+    {
+        std::mutex mutex_;
+        std::unordered_set<ProtocolClient*> clients_;
+
+    public:
+        void Add(ProtocolClient* client)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            clients_.insert(client);
+        }
+
+        void Remove(ProtocolClient* client)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            clients_.erase(client);
+        }
+
+        // Calls `f` with the lock held, so no client is destroyed meanwhile.
+        template<typename F>
+        void ForEach(F f)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (ProtocolClient* client : clients_)
+                f(client);
+        }
+    };
+
+    struct AcceptTarget
+    {
+        asio::io_service* io_service;
+
+        // The shard's ring when connections do their I/O through io_uring.
+        UringLoop* uring;
+
+        // Runs handlers on the shard when there is no separate pool.
+        HandlerQueue* handlers;
+
+        ConnectionSet* connections;
+    };
+
+    class ProtocolClient : public IRecordSender, public std::enable_shared_from_this<ProtocolClient>
+    {
+        asio::io_service& io_service_;
+        HandlerQueue& handlers_;
+        ServerContext& context_;
+        const ServerConfig& config_;
+        asio::generic::stream_protocol::socket socket_;
+
+        // Serializes the reading coroutine, handler completions and writes.
+        asio::strand<asio::io_service::executor_type> strand_;
+
+        ReceiveBuffer buffer_;
+        OutputQueue output_;
+        OutputQueue writing_;
+        bool writeRunning_;
+        int workerId_;
+
+        // When the batch in writing_ started; its duration is the write stall.
+        unsigned long long writeStartNs_;
+
+        asio::yield_context* yield_;
+
+        RequestTable workers_;
+
+        // Body stream whose consumer fell too far behind; reading waits on
+        // resumeTimer_ until it has caught up.
+        std::shared_ptr<BodyStream> throttledBy_;
+        asio::steady_timer resumeTimer_;
+
+        // Set when the socket is read and written through io_uring.
+        UringLoop* uring_;
+
+        // Where the connection is listed while it holds an admission slot.
+        ConnectionSet* connections_;
+
+        // Multishot receive, armed while the reading loop wants data. Each
+        // completion is handed to the strand; the last one releases the client.
+        class RecvOp : public UringOp
+        {
+            std::shared_ptr<ProtocolClient> client_;
+
+        public:
+            explicit RecvOp(std::shared_ptr<ProtocolClient> client)
+                : client_(std::move(client))
+            {
+            }
+
+            void Complete(int result, unsigned int flags) override
+            {
+                bool more = UringQueue::HasMore(flags);
+                int bufferId = UringQueue::BufferId(flags);
+                std::shared_ptr<ProtocolClient> client = more ? client_ : std::move(client_);
+                asio::post(client->strand_, [client, op = this, result, bufferId, more]() {
+                    client->UringReceived(op, result, bufferId, more);
+                });
+                if (!more)
+                    delete this;
+            }
+        };
+
+        // Linked SENDMSG chain for one batch of in-memory records, IOV_MAX
+        // buffers per message. Completions of a chain arrive in order. Only
+        // one batch is written at a time, so each client reuses one of these.
+        class SendOp : public UringOp
+        {
+        public:
+            // Set while the chain is in flight.
+            std::shared_ptr<ProtocolClient> client;
+            OutputQueue::FileSlice slice;
+            std::vector<iovec> iov;
+            std::vector<msghdr> messages;
+            std::vector<std::size_t> lengths;
+
+            // Filled in as completions arrive; `sent` counts the prefix of
+            // the batch known to be on the wire.
+            std::size_t completed;
+            std::size_t sent;
+            bool shortSend;
+            int error;
+
+            void Reset(OutputQueue::FileSlice nextSlice)
+            {
+                slice = nextSlice;
+                iov.clear();
+                messages.clear();
+                lengths.clear();
+                completed = 0;
+                sent = 0;
+                shortSend = false;
+                error = 0;
+            }
+
+            void Complete(int result, unsigned int flags) override
+            {
+                std::size_t expected = lengths[completed++];
+                if (!shortSend && result >= 0 && (std::size_t)result == expected)
+                {
+                    sent += result;
+                }
+                else if (!shortSend)
+                {
+                    shortSend = true;
+                    if (result > 0)
+                        sent += result;
+                    else if (result != -ECANCELED && result != -EAGAIN && result != -EINTR)
+                        error = -result;
+                }
+
+                if (completed == messages.size())
+                {
+                    std::shared_ptr<ProtocolClient> self = std::move(client);
+                    asio::post(self->strand_, [self]() {
+                        self->UringSent();
+                    });
+                }
+            }
+        };
+
+        SendOp sendOp_;
+        UringOp* recvOp_;
+        bool recvReady_;
+        error_code recvError_;
+
+        // Reading waits on this until a receive completion cancels it.
+        asio::steady_timer recvTimer_;
+
+        // Whether the connection counts against maxConnections.
+        bool connected_;
+
+        // Set once a request without FCGI_KEEP_CONN has been answered; the
+        // connection takes no more records and is closed when output drains.
+        bool closing_;
+        bool readingDone_;
+        unsigned int handlersRunning_;
+
+        // Enforces the timeouts and trims memory while the connection is
+        // idle. The counters move whenever the peer gives or takes data;
+        // the tick compares them with what it saw last time.
+        asio::steady_timer watchdog_;
+        unsigned long long receivedCount_;
+        unsigned long long sentCount_;
+        unsigned long long checkedReceived_;
+        unsigned long long checkedSent_;
+        asio::steady_timer::time_point idleSince_;
+        asio::steady_timer::time_point readQuietSince_;
+        asio::steady_timer::time_point writeQuietSince_;
+
+        bool WaitForBodyConsumers()
+        {
+            while (ReadingThrottled())
+            {
+                error_code ec;
+                resumeTimer_.async_wait((*yield_)[ec]);
+                if (!Resumed(ec))
+                    return false;
+            }
+            return true;
+        }
+
+        // Whether reading has to wait for a body consumer; if so, arms
+        // resumeTimer_ for StreamBody to cancel once it has caught up.
+        bool ReadingThrottled()
+        {
+            if (!throttledBy_)
+                return false;
+
+            // Publish the flag before checking, so a consumer that drains
+            // the backlog right now is sure to see it and wake us.
+            throttledBy_->throttled = true;
+            if (throttledBy_->pending <= config_.bodyStreamWindow / 2)
+            {
+                throttledBy_->throttled = false;
+                throttledBy_.reset();
+                return false;
+            }
+
+            // Data keeps arriving on a multishot receive, so it is cancelled
+            // and armed again once reading resumes.
+            if (recvOp_)
+                uring_->Cancel(recvOp_);
+
+            resumeTimer_.expires_at(asio::steady_timer::time_point::max());
+            return true;
+        }
+
+        // The wait on resumeTimer_ ends by cancellation when the consumer
+        // caught up; anything else means the connection is going away.
+        bool Resumed(const error_code& ec)
+        {
+            return ec == asio::error::operation_aborted && socket_.is_open();
+        }
+
+        // Reads whatever the socket has, making sure the buffer can hold at
+        // least `needed` bytes of the record currently being assembled.
+        bool RecvSome(unsigned int needed)
+        {
+            if (uring_)
+            {
+                while (UringRecvPending())
+                {
+                    error_code ec;
+                    recvTimer_.async_wait((*yield_)[ec]);
+                }
+                return UringRecvDone();
+            }
+
+            // A buffer grown for a large record shrinks back between records.
+            buffer_.Release(ReceiveBuffer::default_capacity);
+            buffer_.Reserve(needed);
+
+            error_code ec;
+            std::size_t receivedBytes = socket_.async_read_some(asio::buffer(buffer_.WritePtr(), buffer_.WriteSpace()), (*yield_)[ec]);
+            return Received(ec, receivedBytes);
+        }
+
+        bool Received(const error_code& ec, std::size_t receivedBytes)
+        {
+            if (ec != errc::success)
+            {
+                if ((ec != asio::error::eof || buffer_.Size() > 0) && ec != asio::error::operation_aborted)
+                    LogOutput(LogInfo) << "[" << workerId_ << "] : fail to receive record data - " << ec.message();
+                return false;
+            }
+
+            buffer_.Commit(receivedBytes);
+            receivedCount_ += receivedBytes;
+            Metrics::Add(Metrics::BytesIn, receivedBytes);
+            return true;
+        }
+
+        // Whether reading has to wait for the uring receive, arming it if
+        // needed; if so, recvTimer_ is armed for the next completion to cancel.
+        bool UringRecvPending()
+        {
+            if (recvReady_ || recvError_)
+                return false;
+
+            if (!recvOp_)
+            {
+                RecvOp* op = new RecvOp(shared_from_this());
+                if (!socket_.is_open() || !uring_->Recv(socket_.native_handle(), op))
+                {
+                    delete op;
+                    recvError_ = asio::error::operation_aborted;
+                    return false;
+                }
+                recvOp_ = op;
+            }
+
+            recvTimer_.expires_at(asio::steady_timer::time_point::max());
+            return true;
+        }
+
+        bool UringRecvDone()
+        {
+            if (!recvReady_)
+                return Received(recvError_, 0);
+            recvReady_ = false;
+            return true;
+        }
+
+        // Runs on the strand for every receive completion. The data is copied
+        // into buffer_, so records can span provided buffers and the buffer
+        // goes straight back to the kernel.
+        void UringReceived(UringOp* op, int result, int bufferId, bool more)
+        {
+            if (bufferId >= 0)
+            {
+                if (result > 0)
+                {
+                    buffer_.Reserve(buffer_.Size() + result);
+                    memcpy(buffer_.WritePtr(), uring_->Buffer(bufferId), result);
+                    buffer_.Commit(result);
+                    receivedCount_ += result;
+                    Metrics::Add(Metrics::BytesIn, result);
+                    recvReady_ = true;
+                }
+                uring_->RecycleBuffer(bufferId);
+            }
+            else if (result == 0)
+            {
+                recvError_ = asio::error::eof;
+            }
+            // Running out of buffers or being cancelled for throttling only
+            // ends the receive; it is armed again when reading needs data.
+            else if (result != -ENOBUFS && result != -ECANCELED)
+            {
+                recvError_ = error_code(-result, boost::system::system_category());
+            }
+
+            if (!more && recvOp_ == op)
+                recvOp_ = nullptr;
+            recvTimer_.cancel();
+        }
+
+        // Reading is over; lets a receive still armed finish and release the client.
+        void StopReceiving()
+        {
+            if (recvOp_)
+                uring_->Cancel(recvOp_);
+        }
+
+        bool DispatchPacket(const RecordView& record)
+        {
+            if (closing_)
+                return true;
+
+            Metrics::AddRecord(record.header.type);
+            unsigned short reqId = record.header.RequestId();
+            Worker* worker = workers_.Acquire(reqId, [this]() {
+                return std::unique_ptr<Worker>(new Worker(io_service_, context_, this));
+            });
+
+            bool dispatchResult = worker->FeedPacket(record);
+            if (!dispatchResult)
+            {
+                workers_.Release(reqId, true);
+            }
+            else if (!worker->Running())
+            {
+                unsigned char type = record.header.type;
+                // A request can end on BEGIN_REQUEST (refused), ABORT_REQUEST
+                // or, answered from the cache, on the end of STDIN.
+                if ((type == FCGI_BEGIN_REQUEST || type == FCGI_ABORT_REQUEST || type == FCGI_STDIN) && worker->CloseOnComplete())
+                    closing_ = true;
+                workers_.Release(reqId);
+                CloseIfDone();
+            }
+
+            return dispatchResult;
+        }
+
+        // Dispatches the complete records already in the buffer, up to
+        // readQuantum bytes of them. `turnOver` is set when some are left,
+        // and the caller yields the strand before coming back for them.
+        bool DispatchBufferedPackets(unsigned int& needed, bool& turnOver)
+        {
+            turnOver = false;
+            unsigned int dispatched = 0;
+            RecordView record;
+            while (buffer_.PeekRecord(record, needed))
+            {
+                if (dispatched >= config_.readQuantum)
+                {
+                    turnOver = true;
+                    break;
+                }
+                if (!DispatchPacket(record))
+                    return false;
+                buffer_.Consume(needed);
+                dispatched += needed;
+            }
+            return true;
+        }
+
+        // Runs on the strand. Writes everything submitted so far with as few
+        // gathered writes as possible; batches submitted meanwhile go out
+        // with the next round.
+        void StartWrite()
+        {
+            if (writeRunning_ || output_.Empty())
+                return;
+
+            writeRunning_ = true;
+            writeStartNs_ = Metrics::Now();
+            writing_.Swap(output_);
+            WriteNext();
+        }
+
+        // Writes the in-memory records up to the next file-backed one, then
+        // that record's payload with sendfile, until the batch is done.
+        void WriteNext()
+        {
+            OutputQueue::FileSlice slice;
+            const std::vector<asio::const_buffer>& buffers = writing_.NextBuffers(slice);
+            if (buffers.empty())
+            {
+                WriteComplete(error_code());
+                return;
+            }
+
+            if (uring_)
+                UringSend(buffers, slice);
+            else
+                WriteBuffers(buffers, slice);
+        }
+
+        void WriteBuffers(const std::vector<asio::const_buffer>& buffers, OutputQueue::FileSlice slice)
+        {
+            auto self = shared_from_this();
+            auto progress = [self](const error_code& ec, std::size_t written) {
+                ++self->sentCount_;
+                return asio::transfer_all()(ec, written);
+            };
+            asio::async_write(socket_, buffers, progress, asio::bind_executor(strand_, [self, slice](const error_code& ec, std::size_t written) {
+                Metrics::Add(Metrics::BytesOut, written);
+                self->Written(ec, slice);
+            }));
+        }
+
+        void Written(const error_code& ec, OutputQueue::FileSlice slice)
+        {
+            if (ec != errc::success)
+                WriteComplete(ec);
+            else if (slice.length > 0)
+                SendFileSlice(slice);
+            else
+                WriteNext();
+        }
+
+        void UringSend(const std::vector<asio::const_buffer>& buffers, OutputQueue::FileSlice slice)
+        {
+            SendOp* op = &sendOp_;
+            op->Reset(slice);
+            for (const asio::const_buffer& buffer : buffers)
+                op->iov.push_back(iovec{ const_cast<void*>(buffer.data()), buffer.size() });
+
+            for (std::size_t first = 0; first < op->iov.size(); first += IOV_MAX)
+            {
+                msghdr message;
+                memset(&message, 0, sizeof(message));
+                message.msg_iov = &op->iov[first];
+                message.msg_iovlen = std::min<std::size_t>(IOV_MAX, op->iov.size() - first);
+                op->messages.push_back(message);
+
+                std::size_t length = 0;
+                for (std::size_t i = 0; i < message.msg_iovlen; ++i)
+                    length += message.msg_iov[i].iov_len;
+                op->lengths.push_back(length);
+            }
+
+            op->client = shared_from_this();
+            if (!uring_->Send(socket_.native_handle(), op->messages, op))
+            {
+                op->client.reset();
+                WriteComplete(asio::error::no_buffer_space);
+            }
+        }
+
+        // Runs on the strand once the whole chain has completed. A chain cut
+        // short without an error (the socket was full) is finished by asio.
+        void UringSent()
+        {
+            SendOp* op = &sendOp_;
+            sentCount_ += op->sent;
+            Metrics::Add(Metrics::BytesOut, op->sent);
+            if (op->error)
+            {
+                WriteComplete(error_code(op->error, boost::system::system_category()));
+                return;
+            }
+            if (!op->shortSend)
+            {
+                Written(error_code(), op->slice);
+                return;
+            }
+
+            std::vector<asio::const_buffer> rest;
+            std::size_t skip = op->sent;
+            for (const iovec& v : op->iov)
+            {
+                if (skip >= v.iov_len)
+                {
+                    skip -= v.iov_len;
+                    continue;
+                }
+                rest.push_back(asio::buffer((const char*)v.iov_base + skip, v.iov_len - skip));
+                skip = 0;
+            }
+            WriteBuffers(rest, op->slice);
+        }
+
+        void SendFileSlice(OutputQueue::FileSlice slice)
+        {
+            while (slice.length > 0)
+            {
+                off_t offset = (off_t)slice.offset;
+                ssize_t sent = sendfile(socket_.native_handle(), slice.fd, &offset, slice.length);
+                if (sent > 0)
+                {
+                    sentCount_ += sent;
+                    Metrics::Add(Metrics::BytesOut, sent);
+                    slice.offset += sent;
+                    slice.length -= (unsigned int)sent;
+                }
+                else if (sent < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    auto self = shared_from_this();
+                    socket_.async_wait(asio::socket_base::wait_write, asio::bind_executor(strand_, [self, slice](const error_code& ec) {
+                        if (ec != errc::success)
+                            self->WriteComplete(ec);
+                        else
+                            self->SendFileSlice(slice);
+                    }));
+                    return;
+                }
+                else
+                {
+                    // A file that shrank leaves the record short, which the
+                    // peer cannot recover from, so the connection goes too.
+                    WriteComplete(sent == 0 ? error_code(asio::error::eof) : error_code(errno, boost::system::system_category()));
+                    return;
+                }
+            }
+            WriteNext();
+        }
+
+        void WriteComplete(const error_code& ec)
+        {
+            Metrics::Record(Metrics::WriteStall, Metrics::Now() - writeStartNs_);
+            context_.admission.AddQueuedBytes(-(long long)writing_.QueuedBytes());
+            writing_.Clear();
+            writeRunning_ = false;
+            if (ec != errc::success)
+            {
+                LogOutput(LogInfo) << "[" << workerId_ << "] : fail to send record data - " << ec.message();
+                context_.admission.AddQueuedBytes(-(long long)output_.QueuedBytes());
+                output_.Clear();
+                CloseSocket();
+                StopWatchdogIfDone();
+                return;
+            }
+            StartWrite();
+            CloseIfDone();
+            StopWatchdogIfDone();
+        }
+
+        void FinishRequest(unsigned short reqId)
+        {
+            --handlersRunning_;
+            Worker* worker = workers_.Find(reqId);
+            if (worker)
+            {
+                if (worker->CloseOnComplete())
+                    closing_ = true;
+                unsigned int before = output_.QueuedBytes();
+                worker->Finish(output_);
+                context_.admission.AddQueuedBytes(output_.QueuedBytes() - before);
+                workers_.Release(reqId);
+                StartWrite();
+                CloseIfDone();
+            }
+            StopWatchdogIfDone();
+        }
+
+        // Wakes the reading coroutine so the connection winds down; the
+        // shutdown also ends a uring receive, which closing does not.
+        void CloseSocket()
+        {
+            error_code ignored;
+            socket_.shutdown(asio::socket_base::shutdown_both, ignored);
+            socket_.close(ignored);
+        }
+
+        // Once a closing connection has written everything, only the sending
+        // side is shut down: closing outright could reset the connection and
+        // lose the response if the peer still has data in flight. Reading
+        // ends when the peer closes its side, or at the read timeout.
+        // While the server drains, an idle connection closes the same way,
+        // unless the front end's next request is already waiting unread.
+        void CloseIfDone()
+        {
+            if (context_.draining.load(std::memory_order_relaxed) && workers_.Size() == 0 && buffer_.Size() == 0 && !closing_)
+            {
+                error_code ec;
+                if (socket_.available(ec) == 0 && !ec)
+                    closing_ = true;
+            }
+            if (!closing_ || writeRunning_ || !output_.Empty() || workers_.Size() > 0)
+                return;
+            error_code ignored;
+            socket_.shutdown(asio::socket_base::shutdown_send, ignored);
+        }
+
+        // Handlers still running for a connection that is gone are told to
+        // stop; requests still arriving end with it.
+        void ReadingFinished()
+        {
+            if (uring_)
+                StopReceiving();
+            workers_.ForEach([](unsigned short id, Worker& worker) {
+                worker.Cancel(false);
+            });
+            readingDone_ = true;
+            StopWatchdogIfDone();
+            Metrics::Add(Metrics::ConnectionsClosed);
+        }
+
+        // Interval of the watchdog: a quarter of the shortest timeout, so
+        // they fire at most 25% late, and at least once a minute for trimming.
+        std::chrono::seconds WatchdogTick() const
+        {
+            unsigned int shortest = 240;
+            for (unsigned int timeout : { config_.idleTimeout, config_.readTimeout, config_.writeTimeout, config_.requestTimeout })
+            {
+                if (timeout > 0)
+                    shortest = std::min(shortest, timeout);
+            }
+            return std::chrono::seconds(std::max(1u, shortest / 4));
+        }
+
+        void ArmWatchdog()
+        {
+            auto self = shared_from_this();
+            watchdog_.expires_after(WatchdogTick());
+            watchdog_.async_wait(asio::bind_executor(strand_, [self](const error_code& ec) {
+                if (ec == errc::success)
+                    self->CheckTimeouts();
+            }));
+        }
+
+        // The watchdog holds the client, so it has to stop once nothing more
+        // can happen on the connection.
+        void StopWatchdogIfDone()
+        {
+            if (readingDone_ && !writeRunning_ && handlersRunning_ == 0)
+                watchdog_.cancel();
+        }
+
+        void CancelOverdueRequests()
+        {
+            unsigned long long limit = config_.requestTimeout * 1000000000ull;
+            unsigned long long now = Metrics::Now();
+            std::vector<unsigned short> ended;
+            workers_.ForEach([&](unsigned short id, Worker& worker) {
+                if (worker.Running() && now - worker.BeginNs() >= limit && worker.Cancel(true))
+                    ended.push_back(id);
+            });
+            if (ended.empty())
+                return;
+
+            for (unsigned short id : ended)
+            {
+                if (workers_.Find(id)->CloseOnComplete())
+                    closing_ = true;
+                workers_.Release(id);
+            }
+            CloseIfDone();
+        }
+
+        static bool Expired(asio::steady_timer::time_point since, unsigned int timeout, asio::steady_timer::time_point now)
+        {
+            return timeout > 0 && now - since >= std::chrono::seconds(timeout);
+        }
+
+        void CheckTimeouts()
+        {
+            if (!socket_.is_open() || (readingDone_ && !writeRunning_ && handlersRunning_ == 0))
+                return;
+            CloseIfDone();
+
+            // Reading is expected while a record or request is incomplete,
+            // unless it is held back for a body consumer; a closing
+            // connection waits for the peer to close its side.
+            asio::steady_timer::time_point now = asio::steady_timer::clock_type::now();
+            bool idle = workers_.Size() == 0 && buffer_.Size() == 0 && !writeRunning_ && !closing_;
+            bool reading = !throttledBy_ && (closing_ || buffer_.Size() > 0 || workers_.Size() > handlersRunning_);
+            if (!idle)
+                idleSince_ = now;
+            if (!reading || receivedCount_ != checkedReceived_)
+                readQuietSince_ = now;
+            if (!writeRunning_ || sentCount_ != checkedSent_)
+                writeQuietSince_ = now;
+            checkedReceived_ = receivedCount_;
+            checkedSent_ = sentCount_;
+
+            const char* expired = nullptr;
+            if (Expired(idleSince_, config_.idleTimeout, now))
+                expired = "idle";
+            else if (Expired(readQuietSince_, config_.readTimeout, now))
+                expired = "read";
+            else if (Expired(writeQuietSince_, config_.writeTimeout, now))
+                expired = "write";
+            if (expired)
+            {
+                LogOutput(LogInfo) << "[" << workerId_ << "] : " << expired << " timeout, closing connection";
+                Metrics::Add(Metrics::ConnectionsTimedOut);
+                CloseSocket();
+                return;
+            }
+
+            if (config_.requestTimeout > 0)
+                CancelOverdueRequests();
+
+            // Idle for a whole tick: give back what the last requests grew.
+            // A pending epoll read points into buffer_, so only the uring
+            // path can free it.
+            if (idle && now - idleSince_ >= WatchdogTick())
+            {
+                if (uring_)
+                    buffer_.Release(0);
+                output_.ReleaseMemory();
+                writing_.ReleaseMemory();
+                workers_.Trim();
+            }
+            ArmWatchdog();
+        }
+
+    public:
+        ProtocolClient(const AcceptTarget& target, ServerContext& context, int workerId = 0)
+            : io_service_(*target.io_service)
+            , handlers_(context.handlerQueue ? *context.handlerQueue : *target.handlers)
+            , context_(context)
+            , config_(context.config)
+            , socket_(io_service_)
+            , strand_(asio::make_strand(io_service_))
+            , writeRunning_{}
+            , workerId_(workerId)
+            , writeStartNs_{}
+            , yield_{}
+            , resumeTimer_(io_service_)
+            , uring_(target.uring)
+            , connections_(target.connections)
+            , recvOp_{}
+            , recvReady_{}
+            , recvTimer_(io_service_)
+            , connected_{}
+            , closing_{}
+            , readingDone_{}
+            , handlersRunning_{}
+            , watchdog_(io_service_)
+            , receivedCount_{}
+            , sentCount_{}
+            , checkedReceived_{}
+            , checkedSent_{}
+        {
+        }
+        
+        ~ProtocolClient()
+        {
+            context_.admission.AddQueuedBytes(-(long long)(output_.QueuedBytes() + writing_.QueuedBytes()));
+            if (connected_)
+            {
+                context_.admission.Disconnect();
+                if (connections_)
+                    connections_->Remove(this);
+            }
+            if (socket_.is_open())
+                socket_.close();
+        }
+
+        // Takes a slot under maxConnections; false if none is left.
+        bool AdmitConnection()
+        {
+            connected_ = context_.admission.TryConnect();
+            if (connected_ && connections_)
+                connections_->Add(this);
+            return connected_;
+        }
+
+        // Lets a connection that is between requests close now that the
+        // server drains; a busy one still closes once it is done. One that
+        // has not received anything yet was opened for a request that is
+        // on its way, and is left to its watchdog.
+        void CloseIfIdle()
+        {
+            auto self = shared_from_this();
+            asio::post(strand_, [self]() {
+                if (self->receivedCount_ > 0)
+                    self->CloseIfDone();
+            });
+        }
+
+        asio::generic::stream_protocol::socket& Socket()
+        {
+            return socket_;
+        }
+
+        asio::strand<asio::io_service::executor_type>& Strand()
+        {
+            return strand_;
+        }
+
+        void Submit(OutputQueue&& records) override
+        {
+            auto self = shared_from_this();
+            asio::dispatch(strand_, [self, records = std::move(records)]() mutable {
+                self->context_.admission.AddQueuedBytes(records.QueuedBytes());
+                self->output_.Append(std::move(records));
+                self->StartWrite();
+            });
+        }
+
+        unsigned int ActiveRequests() override
+        {
+            return workers_.Size() - 1;
+        }
+
+        // Runs `handler`, then finishes the request on the connection.
+        std::function<void()> HandlerTask(unsigned short reqId, std::function<void()> handler)
+        {
+            auto self = shared_from_this();
+            return [self, reqId, handler = std::move(handler)]() {
+                unsigned long long start = Metrics::Now();
+                handler();
+                Metrics::Record(Metrics::HandlerTime, Metrics::Now() - start);
+                asio::dispatch(self->strand_, [self, reqId]() {
+                    self->FinishRequest(reqId);
+                });
+            };
+        }
+
+        void Execute(unsigned short reqId, std::function<void()> handler, HandlerPriority priority, asio::strand<asio::io_service::executor_type>* strand) override
+        {
+            ++handlersRunning_;
+            std::function<void()> task = HandlerTask(reqId, std::move(handler));
+            if (strand)
+                asio::post(*strand, std::move(task));
+            else
+                handlers_.Post(priority, std::move(task));
+        }
+
+        std::function<void()> Defer(unsigned short reqId, std::function<void()> handler, HandlerPriority priority) override
+        {
+            ++handlersRunning_;
+            HandlerQueue* handlers = &handlers_;
+            return [handlers, priority, task = HandlerTask(reqId, std::move(handler))]() {
+                handlers->Post(priority, task);
+            };
+        }
+
+        void StreamBody(const std::shared_ptr<BodyStream>& stream, RecordBufPtr chunk) override
+        {
+            unsigned int len = chunk->header.ContentLength();
+            stream->pending += len;
+            context_.admission.AddQueuedBytes(len);
+            if (stream->pending > config_.bodyStreamWindow)
+                throttledBy_ = stream;
+
+            auto self = shared_from_this();
+            asio::post(stream->strand, [self, stream, chunk = std::move(chunk), len]() {
+                stream->consumer->OnBodyData(chunk->content, len);
+                self->context_.admission.AddQueuedBytes(-(long long)len);
+
+                long long pending = stream->pending -= len;
+                if (pending <= self->config_.bodyStreamWindow / 2 && stream->throttled.exchange(false))
+                {
+                    asio::dispatch(self->strand_, [self]() {
+                        self->resumeTimer_.cancel();
+                    });
+                }
+            });
+        }
+
+        asio::io_service& HandlerService() override
+        {
+            return handlers_.IoService();
+        }
+
+        // Starts reading on Strand() as a stackful or, where the build
+        // supports it, a stackless coroutine (config.coroutines).
+        void Run()
+        {
+            // sendfile is issued on the descriptor directly and must not block the strand.
+            error_code ec;
+            socket_.native_non_blocking(true, ec);
+
+            asio::steady_timer::time_point now = asio::steady_timer::clock_type::now();
+            idleSince_ = readQuietSince_ = writeQuietSince_ = now;
+            ArmWatchdog();
+
+#ifdef SORA_FCGI_HAS_AWAITABLE
+            if (config_.coroutines == "stackless")
+            {
+                asio::co_spawn(strand_, ReadLoop(shared_from_this()), asio::detached);
+                return;
+            }
+#endif
+            asio::spawn(strand_, std::bind(&ProtocolClient::Start, shared_from_this(), std::placeholders::_1));
+        }
+
+#ifdef SORA_FCGI_HAS_AWAITABLE
+        // Same loop as Start, but the frame lives in a small heap allocation
+        // instead of a stack of its own. `self` keeps the client alive.
+        asio::awaitable<void> ReadLoop(std::shared_ptr<ProtocolClient> self)
+        {
+            Metrics::Add(Metrics::ConnectionsOpened);
+            for (;;)
+            {
+                unsigned int needed;
+                bool turnOver;
+                if (!DispatchBufferedPackets(needed, turnOver))
+                    break;
+
+                bool resumed = true;
+                while (resumed && ReadingThrottled())
+                {
+                    error_code ec;
+                    co_await resumeTimer_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                    resumed = Resumed(ec);
+                }
+                if (!resumed)
+                    break;
+
+                if (turnOver)
+                {
+                    co_await asio::post(strand_, asio::use_awaitable);
+                    continue;
+                }
+
+                if (uring_)
+                {
+                    while (UringRecvPending())
+                    {
+                        error_code ec;
+                        co_await recvTimer_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+                    }
+                    if (!UringRecvDone())
+                        break;
+                    continue;
+                }
+
+                buffer_.Release(ReceiveBuffer::default_capacity);
+                buffer_.Reserve(needed);
+                error_code ec;
+                std::size_t receivedBytes = co_await socket_.async_read_some(asio::buffer(buffer_.WritePtr(), buffer_.WriteSpace()),
+                    asio::redirect_error(asio::use_awaitable, ec));
+                if (!Received(ec, receivedBytes))
+                    break;
+            }
+            ReadingFinished();
+        }
+#endif
+
+        // Must run on Strand().
+        bool Start(asio::yield_context yield)
+        {
+            yield_ = &yield;
+
+            Metrics::Add(Metrics::ConnectionsOpened);
+            for (;;)
+            {
+                unsigned int needed;
+                bool turnOver;
+                if (!DispatchBufferedPackets(needed, turnOver))
+                    break;
+
+                if (!WaitForBodyConsumers())
+                    break;
+
+                if (turnOver)
+                {
+                    asio::post(strand_, yield);
+                    continue;
+                }
+
+                if (!RecvSome(needed))
+                    break;
+            }
+            ReadingFinished();
+
+            yield_ = nullptr;
+            return false;
+        }
+    };
+
+    class Acceptor : public UringOp
+    {
+        asio::io_service& io_service_;
+        ServerContext& context_;
+        const ServerConfig& config_;
+        asio::basic_socket_acceptor<asio::generic::stream_protocol> acceptor_;
+
+        // Serializes everything that touches acceptor_ when the shard has
+        // several threads: the accept loop, re-arming and Close.
+        asio::strand<asio::io_service::executor_type> strand_;
+
+        // Shards that accepted connections are handed to, round-robin.
+        std::vector<AcceptTarget> targets_;
+        unsigned int nextTarget_;
+
+        // Ring of this acceptor's own shard, for the multishot accept.
+        UringLoop* uring_;
+        int family_;
+        asio::steady_timer retryTimer_;
+
+        // Set by Close; the uring accept completes on the reaping thread.
+        std::atomic<bool> closed_;
+
+        static std::atomic_int workerId_;
+
+        bool OpenTcp()
+        {
+            error_code ec;
+            asio::ip::address address = asio::ip::address::from_string(config_.address, ec);
+            if (ec != errc::success || config_.port > ushort_max)
+            {
+                LogOutput(LogError) << "invalid listen address : " << config_.address << " port " << config_.port;
+                return false;
+            }
+            asio::ip::tcp::endpoint endpoint(address, (unsigned short)config_.port);
+
+            acceptor_.open(endpoint.protocol(), ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogError) << "fail to create socket : " << ec.message();
+                return false;
+            }
+
+            acceptor_.set_option(asio::socket_base::reuse_address(true), ec);
+            if (config_.reusePort)
+            {
+                acceptor_.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+                if (ec != errc::success)
+                {
+                    LogOutput(LogError) << "fail to set SO_REUSEPORT : " << ec.message();
+                    return false;
+                }
+            }
+
+            acceptor_.bind(endpoint, ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogError) << "fail to bind port : " << ec.message();
+                return false;
+            }
+            return true;
+        }
+
+        bool OpenUnix()
+        {
+            error_code ec;
+            asio::local::stream_protocol::endpoint endpoint(config_.unixPath);
+
+            acceptor_.open(endpoint.protocol(), ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogError) << "fail to create socket : " << ec.message();
+                return false;
+            }
+
+            // A socket file left behind by a previous run would make bind fail.
+            struct stat st;
+            if (stat(config_.unixPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(config_.unixPath.c_str());
+
+            acceptor_.bind(endpoint, ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogError) << "fail to bind " << config_.unixPath << " : " << ec.message();
+                return false;
+            }
+            return true;
+        }
+
+        // Counts the accept and holds it to maxConnections.
+        bool Admit(ProtocolClient& worker)
         {
-            params_.clear();
-            stdin_buf_.consume(stdin_buf_.size());
+            Metrics::Add(Metrics::Accepts);
+            if (worker.AdmitConnection())
+                return true;
+            Metrics::Add(Metrics::ConnectionsRejected);
+            return false;
         }
 
-        bool OnBeginRequest(RecordBufPtr buf)
+    public:
+        Acceptor(asio::io_service& io_service, ServerContext& context, std::vector<AcceptTarget> targets, UringLoop* uring = nullptr)
+            : io_service_(io_service)
+            , context_(context)
+            , config_(context.config)
+            , acceptor_(io_service_)
+            , strand_(asio::make_strand(io_service_))
+            , targets_(std::move(targets))
+            , nextTarget_{}
+            , uring_(uring)
+            , family_(AF_UNSPEC)
+            , retryTimer_(io_service_)
+            , closed_{}
         {
-            ResetBuffer();
-            reqId_ = buf->header.RequestId();
-
-            FCGI_BeginRequestBody* br = (FCGI_BeginRequestBody*)buf->content;
+        }
 
-            unsigned short role = (br->roleB1 << 8) | br->roleB0;
-            if (role != FCGI_RESPONDER)
+        // Creates, binds and listens on the socket described by the config.
+        bool Open()
+        {
+            if (config_.transport == "unix" ? !OpenUnix() : !OpenTcp())
                 return false;
 
-            requestRunning_ = true;
-            closeOnComplete_ = !(br->flags & FCGI_KEEP_CONN);
+            error_code ec;
+            acceptor_.listen(config_.backlog, ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogError) << "fail to listen on port : " << ec.message();
+                return false;
+            }
 
             return true;
         }
 
-        bool OnParam(RecordBufPtr buf)
+        // Takes ownership of a socket that is already listening.
+        bool Adopt(int fd)
         {
-            int len = buf->header.ContentLength();
-            const char* beginPtr = buf->content;
-            const char* endPtr = buf->content + len;
-
-            while (beginPtr < endPtr)
+            sockaddr_storage address;
+            socklen_t addressLen = sizeof(address);
+            if (getsockname(fd, (sockaddr*)&address, &addressLen) != 0)
             {
-                std::string key, value;
-                const char* newBeginPtr = ReadKeyValuePair(beginPtr, key, value);
-                if (newBeginPtr == beginPtr) 
-                    return false;
-                beginPtr = newBeginPtr;
-                params_[key] = value;
+                LogOutput(LogError) << "fail to query listening socket " << fd << " : " << strerror(errno);
+                return false;
             }
 
+            int protocol = address.ss_family == AF_UNIX ? 0 : IPPROTO_TCP;
+            error_code ec;
+            acceptor_.assign(asio::generic::stream_protocol(address.ss_family, protocol), fd, ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogError) << "fail to adopt listening socket " << fd << " : " << ec.message();
+                return false;
+            }
             return true;
         }
 
-        bool OnAbortRequest(RecordBufPtr buf)
+        int NativeHandle()
         {
-            requestRunning_ = false;
-            return true;
+            return acceptor_.native_handle();
         }
 
-        bool OnGetValues(RecordBufPtr buf)
+        asio::strand<asio::io_service::executor_type>& Strand()
         {
-            return true;
+            return strand_;
         }
 
-        bool OnStdinData(RecordBufPtr buf)
+        // Stops accepting and closes this acceptor's descriptor; other
+        // descriptors of the same listening socket are not affected.
+        // Runs on the strand.
+        void Close()
         {
-            int contentLen = buf->header.ContentLength();
-            if (contentLen > 0)
-            {
-                std::ostream(&stdin_buf_).write(buf->content, contentLen);
-                return true;
-            }
-            else
-            {
-                return OnStdinComplete();
-            }
+            closed_ = true;
+            retryTimer_.cancel();
+            if (uring_)
+                uring_->Cancel(this);
+            error_code ignored;
+            acceptor_.close(ignored);
         }
 
-        bool OnStdinComplete()
+        bool Start(asio::yield_context yield)
         {
-            std::stringstream ss;
-#if 0
-            ss << "Content-type: text/plain\r\n\r\n";
-            SendStdout(buf, sizeof(buf) - 1);
-
-            for (auto& x : params_)
+            error_code ec;
+            for (;;)
             {
-                ss << x.first << " = " << x.second << '\r' << '\n';
-            }
+                // The socket is created on the shard that will serve it, so
+                // the connection never touches another shard's reactor.
+                const AcceptTarget& target = targets_[nextTarget_];
+                nextTarget_ = (nextTarget_ + 1) % targets_.size();
 
-#else
-            ss << "Content-type: text/html\r\n\r\n";
-            ss << "<html><body>"
-                "<head><title>calculator</title></head>"
-                "<form action=? method=POST>"
-                "<p>a=<input name='a' type='text' /></p>"
-                "<p>b=<input name='b' type='text' /></p>"
-                "<p><input type='submit' /></p>"
-                "</form>";
-
-            if (params_["REQUEST_METHOD"] == "POST")
-            {
-                std::ostream(&stdin_buf_).write("", 1);
-                std::string tmp;
-                std::getline(std::istream(&stdin_buf_), tmp);
-                int a, b;
-                if (sscanf(tmp.c_str(), "a=%d&b=%d", &a, &b) == 2)
+                std::shared_ptr<ProtocolClient> worker = std::make_shared<ProtocolClient>(target, context_, workerId_++);
+                acceptor_.async_accept(worker->Socket(), yield[ec]);
+                if (ec != errc::success)
                 {
-                    ss << "<p>" << a << "+" << b << "=" << a + b << "</p>";
+                    if (closed_)
+                        return false;
+                    LogOutput(LogWarning) << "fail to accept client : " << ec.message();
+                }
+                else if (!Admit(*worker))
+                {
+                    worker->Socket().close(ec);
                 }
                 else
                 {
-                    ss << "<p>invalid parameters</p>";
+                    if (worker->Socket().local_endpoint(ec).protocol().family() != AF_UNIX)
+                        worker->Socket().set_option(asio::ip::tcp::no_delay(true), ec);
+
+                    target.io_service->post([worker](){
+                        worker->Run();
+                    });
                 }
             }
+        }
 
-            ss << "</body></html>";
-#endif
-            std::string s = ss.str();
-            SendStdout(s.c_str(), s.size());
-            SendStdout(0, 0);
-            SendEndRequest(0, FCGI_REQUEST_COMPLETE);
-
-            requestRunning_ = false;
+        // Arms a multishot accept on the ring of the acceptor's shard; each
+        // completion carries a connected socket for the next target.
+        bool StartUring()
+        {
+            error_code ec;
+            family_ = acceptor_.local_endpoint(ec).protocol().family();
+            if (!uring_->Accept(acceptor_.native_handle(), this))
+            {
+                LogOutput(LogError) << "fail to start accepting through io_uring";
+                return false;
+            }
             return true;
         }
 
-        bool SendStdout(const char* data, int len)
+        // Runs on the reaping thread, one at a time; re-arming touches the
+        // acceptor and so goes through the strand.
+        void Complete(int result, unsigned int flags) override
         {
-            while (len > 0 || data == 0)
-            {
-                int curlen = std::min<int>(len, ushort_max);
-                RecordBuf* record = RecordBuf::Create(reqId_, FCGI_STDOUT, curlen);
-                if (curlen > 0)
-                    memcpy(record->content, data, curlen);
-                sender_->SendBufferAndDelete(record);
+            if (result >= 0)
+                Accepted(result);
+            else if (!closed_)
+                LogOutput(LogWarning) << "fail to accept client : " << strerror(-result);
 
-                if (data == 0)
-                    break;
+            if (UringQueue::HasMore(flags) || closed_)
+                return;
 
-                len -= curlen;
-                data += curlen;
+            // The accept ended, typically out of descriptors; pause before
+            // trying again so the failure does not spin.
+            if (result < 0)
+            {
+                asio::post(strand_, [this]() {
+                    if (closed_)
+                        return;
+                    retryTimer_.expires_after(std::chrono::milliseconds(100));
+                    retryTimer_.async_wait(asio::bind_executor(strand_, [this](const error_code& ec) {
+                        if (ec == errc::success && !closed_)
+                            StartUring();
+                    }));
+                });
+            }
+            else
+            {
+                asio::post(strand_, [this]() {
+                    if (!closed_)
+                        StartUring();
+                });
             }
-            return true;
         }
 
-        bool SendEndRequest(unsigned int exitcode, unsigned int statuscode)
+        void Accepted(int fd)
         {
-            RecordBuf* record = RecordBuf::Create(reqId_, FCGI_END_REQUEST, sizeof(FCGI_EndRequestBody));
+            AcceptTarget& target = targets_[nextTarget_];
+            nextTarget_ = (nextTarget_ + 1) % targets_.size();
 
-            FCGI_EndRequestBody* body = (FCGI_EndRequestBody*)record->content;
-            body->protocolStatus = statuscode;
-            body->appStatusB3 = exitcode >> 24;
-            body->appStatusB2 = (exitcode >> 16) & 0xff;
-            body->appStatusB1 = (exitcode >> 8) & 0xff;
-            body->appStatusB0 = exitcode & 0xff;
+            std::shared_ptr<ProtocolClient> worker = std::make_shared<ProtocolClient>(target, context_, workerId_++);
+            error_code ec;
+            worker->Socket().assign(asio::generic::stream_protocol(family_, family_ == AF_UNIX ? 0 : IPPROTO_TCP), fd, ec);
+            if (ec != errc::success)
+            {
+                LogOutput(LogWarning) << "fail to adopt accepted client : " << ec.message();
+                close(fd);
+                return;
+            }
 
-            sender_->SendBufferAndDelete(record);
-            return true;
+            if (!Admit(*worker))
+                return;
+            if (family_ != AF_UNIX)
+                worker->Socket().set_option(asio::ip::tcp::no_delay(true), ec);
+
+            target.io_service->post([worker](){
+                worker->Run();
+            });
         }
+    };
+
+    std::atomic_int Acceptor::workerId_;
+
+    // An io_service with its own threads. Nothing is shared between shards
+    // except admission counters, so each one scales like a separate process.
+    class Shard
+    {
+        // Declared first: connections left in the io_service's queue are
+        // destroyed with it and take themselves off the set.
+        ConnectionSet connections_;
+        asio::io_service io_service_;
+        asio::io_service::work work_;
+        HandlerQueue handlers_;
+        std::unique_ptr<UringLoop> uring_;
+        std::unique_ptr<Acceptor> acceptor_;
+        std::vector<std::thread> threads_;
 
     public:
-        Worker(asio::io_service& io_service, IRecordSender* sender)
-            : io_service_(io_service)
-            , sender_(sender)
-            , requestRunning_{}
-            , closeOnComplete_{}
+        explicit Shard(const ServerConfig& config)
+            : work_(io_service_)
+            , handlers_(io_service_, config)
         {
         }
 
-        bool FeedPacket(RecordBufPtr buf)
+        asio::io_service& IoService()
         {
-            bool result = true;
+            return io_service_;
+        }
 
-            bool notProcessed = false;
+        HandlerQueue& Handlers()
+        {
+            return handlers_;
+        }
 
-            if (!requestRunning_)
-            {
-                switch (buf->header.type)
-                {
-                case FCGI_BEGIN_REQUEST:
-                    result = OnBeginRequest(std::move(buf));
-                    break;
-                case FCGI_GET_VALUES:
-                    result = OnGetValues(std::move(buf));
-                    break;
-                default:
-                    notProcessed = true;
-                    break;
-                }
-            }
-            else
-            {
-                switch (buf->header.type)
-                {
-                case FCGI_PARAMS:
-                    result = OnParam(std::move(buf));
-                    break;
+        // Moves the shard's socket I/O onto an io_uring instance of its own.
+        bool EnableUring(const ServerConfig& config)
+        {
+            uring_.reset(new UringLoop(io_service_));
+            return uring_->Init(config);
+        }
 
-                case FCGI_STDIN:
-                    result = OnStdinData(std::move(buf));
-                    break;
+        AcceptTarget Target()
+        {
+            return AcceptTarget{ &io_service_, uring_.get(), &handlers_, &connections_ };
+        }
 
-                case FCGI_ABORT_REQUEST:
-                    result = OnAbortRequest(std::move(buf));
-                    break;
+        // Starts accepting on a new listener, or on `fd` if it is not -1.
+        bool Listen(ServerContext& context, std::vector<AcceptTarget> targets, int fd = -1)
+        {
+            acceptor_.reset(new Acceptor(io_service_, context, std::move(targets), uring_.get()));
+            if (fd == -1 ? !acceptor_->Open() : !acceptor_->Adopt(fd))
+                return false;
 
-                default:
-                    notProcessed = true;
-                    break;
-                }
-            }
+            if (uring_)
+                return acceptor_->StartUring();
 
-            if (notProcessed)
-            {
-                LogOutput() << "ReqId:" << buf->header.RequestId() << " Unsupported type " << (int)buf->header.type;
+            Acceptor* acceptor = acceptor_.get();
+            asio::spawn(acceptor->Strand(), [acceptor](asio::yield_context yield){
+                acceptor->Start(yield);
+            });
+            return true;
+        }
 
-                result = true;
+        int ListenerHandle()
+        {
+            return acceptor_->NativeHandle();
+        }
+
+        // Closes the shard's listener; accepted connections carry on.
+        void StopAccepting()
+        {
+            Acceptor* acceptor = acceptor_.get();
+            if (acceptor)
+                asio::post(acceptor->Strand(), [acceptor]() { acceptor->Close(); });
+        }
+
+        // Has every connection that is between requests close right away.
+        void CloseIdle()
+        {
+            // Collected first: dropping the last reference to a client
+            // under the set's lock would deadlock in its destructor.
+            std::vector<std::shared_ptr<ProtocolClient>> clients;
+            connections_.ForEach([&clients](ProtocolClient* client) {
+                // Null once the client's destructor is about to take it off the set.
+                if (std::shared_ptr<ProtocolClient> self = client->weak_from_this().lock())
+                    clients.push_back(std::move(self));
+            });
+            for (auto& client : clients)
+                client->CloseIfIdle();
+        }
+
+        // Makes the shard's threads return from Run, leaving whatever is
+        // still queued on the io_service.
+        void Stop()
+        {
+            io_service_.stop();
+        }
+
+        void Run(unsigned int threadCount, int firstCpu, unsigned int cpuCount)
+        {
+            for (unsigned int i = 0; i < threadCount; ++i)
+            {
+                threads_.emplace_back([this]() { io_service_.run(); });
+                if (firstCpu >= 0)
+                {
+                    cpu_set_t cpus;
+                    CPU_ZERO(&cpus);
+                    CPU_SET((firstCpu + i) % cpuCount, &cpus);
+                    int err = pthread_setaffinity_np(threads_.back().native_handle(), sizeof(cpus), &cpus);
+                    if (err != 0)
+                        LogOutput(LogError) << "fail to set thread affinity to cpu " << (firstCpu + i) % cpuCount << " : " << strerror(err);
+                }
             }
+        }
 
-            return result;
+        void Join()
+        {
+            for (auto& thread : threads_)
+                thread.join();
         }
     };
 
-    class ProtocolClient : public IRecordSender
+    bool IsListeningSocket(int fd)
     {
-        asio::io_service& io_service_;
-        asio::ip::tcp::socket socket_;
-        asio::streambuf buffer_;
-        int workerId_;
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening;
+    }
 
-        asio::yield_context* yield_;
+    class Server
+    {
+        const ServerConfig& config_;
+        ServerContext context_;
+        std::vector<std::unique_ptr<Shard>> shards_;
+
+        // Separate pool for request handlers when config.handlerThreads > 0.
+        std::unique_ptr<Shard> handlerPool_;
 
-        SoraFCGIHeader currentHeader_;
+        // On the first shard: SIGTERM and SIGINT, and the poll of a drain.
+        std::unique_ptr<asio::signal_set> signals_;
+        std::unique_ptr<asio::steady_timer> drainTimer_;
+        asio::steady_timer::time_point drainDeadline_;
 
-        std::array<std::unique_ptr<Worker>, 0xffff> workers_;
+        // Where to tell a supervisor that the server is up; -1 without one.
+        int supervisorFd_;
 
-        bool RecvHeader()
+        // The configured transport with "auto" decided; empty if unknown.
+        std::string Transport()
         {
-            if (buffer_.size() < FCGI_HEADER_LEN)
+            std::string transport = config_.transport;
+            if (transport == "auto")
+                transport = IsListeningSocket(FCGI_LISTENSOCK_FILENO) ? "inherit" : "tcp";
+            if (transport != "tcp" && transport != "unix" && transport != "inherit")
             {
-                error_code ec;
-                int receivedBytes = asio::async_read(socket_, buffer_, asio::transfer_at_least(FCGI_HEADER_LEN - buffer_.size()), (*yield_)[ec]);
-
-                if (ec == asio::error::eof)
-                    return false;
+                LogOutput(LogError) << "unknown transport : " << transport;
+                return std::string();
+            }
+            return transport;
+        }
 
+        // The first signal drains, a second one stops at once.
+        void WaitForSignal()
+        {
+            signals_->async_wait([this](const error_code& ec, int signo) {
                 if (ec != errc::success)
+                    return;
+                if (context_.draining)
                 {
-                    LogOutput() << "[" << workerId_ << "] : fail to receive header data - " << ec.message();
-                    return false;
+                    LogOutput(LogInfo) << "signal " << signo << " while draining, stopping";
+                    Stop();
+                    return;
                 }
-            }
-            return true;
+                Drain();
+                WaitForSignal();
+            });
         }
 
-        bool RecvRecordContent()
+        // Stops accepting and waits for the connections to finish what is
+        // in progress; each closes once it is idle.
+        void Drain()
         {
-            unsigned int totalLen = currentHeader_.BodyLength();
-            if (buffer_.size() < totalLen)
+            LogOutput(LogInfo) << "draining " << context_.admission.Connections() << " connections";
+            context_.draining = true;
+            for (auto& shard : shards_)
             {
-                error_code ec;
-                asio::async_read(socket_, buffer_, asio::transfer_at_least(totalLen - buffer_.size()), (*yield_)[ec]);
-                if (ec != errc::success)
-                {
-                    LogOutput() << "[" << workerId_ << "] : fail to receive content data - " << ec.message();
-                    return false;
-                }
+                shard->StopAccepting();
+                shard->CloseIdle();
             }
-            return true;
+            drainDeadline_ = asio::steady_timer::clock_type::now() + std::chrono::seconds(config_.drainTimeout);
+            CheckDrained();
         }
 
-        bool DispatchPacket()
+        // Stops once the last connection is gone or at the deadline,
+        // looking again every 100 ms until then.
+        void CheckDrained()
         {
-            int reqId = currentHeader_.RequestId();
-            if (!workers_[reqId])
+            unsigned int connections = context_.admission.Connections();
+            if (connections == 0)
             {
-                workers_[reqId].reset(new Worker(io_service_, this));
+                Stop();
+                return;
             }
-            RecordBufPtr buf(RecordBuf::Create(currentHeader_));
-            std::istream(&buffer_).read(buf->content, currentHeader_.BodyLength());
-            
-            bool dispatchResult = workers_[reqId]->FeedPacket(std::move(buf));
-            if (!dispatchResult)
+            if (asio::steady_timer::clock_type::now() >= drainDeadline_)
             {
-                workers_[reqId].reset();
+                LogOutput(LogWarning) << "drain timeout, dropping " << connections << " connections";
+                Stop();
+                return;
             }
 
-            return dispatchResult;
+            drainTimer_->expires_after(std::chrono::milliseconds(100));
+            drainTimer_->async_wait([this](const error_code& ec) {
+                if (ec == errc::success)
+                    CheckDrained();
+            });
         }
 
-    public:
-        ProtocolClient(asio::io_service& io_service, int workerId = 0)
-            : io_service_(io_service)
-            , workerId_(workerId)
-            , socket_(io_service_)
-            , yield_{}
-            , workers_{}
-        {
-        }
-        
-        ~ProtocolClient()
+        void Stop()
         {
-            if (socket_.is_open())
-                socket_.close();
+            for (auto& shard : shards_)
+                shard->Stop();
+            if (handlerPool_)
+                handlerPool_->Stop();
         }
 
-        asio::ip::tcp::socket& Socket()
+    public:
+        Server(const ServerConfig& config, const Router& router)
+            : config_(config)
+            , context_(config, router)
+            , supervisorFd_(-1)
         {
-            return socket_;
         }
 
-        bool SendBufferAndDelete(RecordBuf* record) override
+        // Opens the listening socket for a supervisor to hand to its
+        // workers. Returns its descriptor, or -1.
+        int OpenListener()
         {
-            error_code ec;
-            RecordBufPtr p(record);
-            asio::async_write(socket_, asio::buffer((char*)record, record->header.TotalLength()), asio::transfer_exactly(record->header.TotalLength()), (*yield_)[ec]);
-            return ec == errc::success;
+            std::string transport = Transport();
+            if (transport.empty())
+                return -1;
+            if (transport == "inherit")
+                return FCGI_LISTENSOCK_FILENO;
+
+            asio::io_service io_service;
+            Acceptor acceptor(io_service, context_, {});
+            if (!acceptor.Open())
+                return -1;
+            int fd = fcntl(acceptor.NativeHandle(), F_DUPFD_CLOEXEC, 0);
+            if (fd < 0)
+                LogOutput(LogError) << "fail to duplicate listening socket : " << strerror(errno);
+            return fd;
         }
 
-        bool Start(asio::yield_context yield)
+        bool Run()
         {
-            yield_ = &yield;
-
-            for (;;)
-            {
-                if (!RecvHeader())
-                    return false;
+            // Taken before any shard or handler thread can be reading the environment.
+            supervisorFd_ = TakeSupervisorFd();
 
-                std::istream(&buffer_).read((char*)&currentHeader_, FCGI_HEADER_LEN);
+            unsigned int shardCount = config_.shards;
+            if (shardCount == 0)
+                shardCount = std::max(1u, std::thread::hardware_concurrency());
+            unsigned int threadsPerShard = std::max(1u, config_.threadsPerShard);
 
-                if (!RecvRecordContent())
-                    return false;
+            if (config_.io != "epoll" && config_.io != "uring")
+            {
+                LogOutput(LogError) << "unknown io backend : " << config_.io;
+                return false;
+            }
 
-                if (!DispatchPacket())
+            std::vector<AcceptTarget> all;
+            for (unsigned int i = 0; i < shardCount; ++i)
+            {
+                shards_.emplace_back(new Shard(config_));
+                if (config_.io == "uring" && !shards_.back()->EnableUring(config_))
                     return false;
+                all.push_back(shards_.back()->Target());
             }
 
-            yield_ = nullptr;
-        }
-    };
-
-    class Acceptor
-    {
-        asio::io_service& io_service_;
-        asio::ip::tcp::acceptor acceptor_;
-        std::atomic_int workerId_;
-
-    public:
-        Acceptor(asio::io_service& io_service)
-            : io_service_(io_service)
-            , acceptor_(io_service_)
-        {
-        }
-
-        bool Start(asio::yield_context yield)
-        {
-            error_code ec;
-            acceptor_.open(asio::ip::tcp::v4(), ec);
-            if (ec != errc::success)
+            if (config_.handlerThreads > 0)
             {
-                LogOutput() << "fail to create socket : " << ec;
-                return false;
+                handlerPool_.reset(new Shard(config_));
+                context_.handlerQueue = &handlerPool_->Handlers();
             }
-            
-            acceptor_.bind(asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 6666), ec);
-            if (ec != errc::success)
+            else
             {
-                LogOutput() << "fail to bind port : " << ec.message();
-                return false;
+                // Handlers run on the shards, so a backlog on one shard can
+                // be worked off by the others.
+                for (auto& shard : shards_)
+                {
+                    std::vector<HandlerQueue*> siblings;
+                    for (auto& other : shards_)
+                    {
+                        if (other != shard)
+                            siblings.push_back(&other->Handlers());
+                    }
+                    shard->Handlers().SetSiblings(std::move(siblings));
+                }
             }
 
-            acceptor_.listen(ushort_max, ec);
-            if (ec != errc::success)
+            std::string transport = Transport();
+            if (transport.empty())
+                return false;
+
+#ifdef SORA_FCGI_HAS_AWAITABLE
+            if (config_.coroutines != "stackful" && config_.coroutines != "stackless")
+#else
+            if (config_.coroutines != "stackful")
+#endif
             {
-                LogOutput() << "fail to listen on port : " << ec.message();
+                LogOutput(LogError) << "unsupported coroutines : " << config_.coroutines;
                 return false;
             }
 
-            for (;;)
+            if (config_.reusePort && transport == "tcp")
             {
-                std::shared_ptr<ProtocolClient> worker{ new ProtocolClient(io_service_, workerId_++) };
-                asio::ip::tcp::endpoint fcgi_remote_endpoint;
-                acceptor_.async_accept(worker->Socket(), fcgi_remote_endpoint, yield[ec]);
-                if (ec != errc::success)
+                for (auto& shard : shards_)
                 {
-                    LogOutput() << "fail to accept client : " << ec.message();
+                    if (!shard->Listen(context_, { shard->Target() }))
+                        return false;
                 }
-                else
+            }
+            else
+            {
+                // Unix and inherited sockets cannot be balanced by SO_REUSEPORT,
+                // so shards share the one listener through duplicated descriptors.
+                int fd = transport == "inherit" ? FCGI_LISTENSOCK_FILENO : -1;
+                if (!shards_[0]->Listen(context_, config_.reusePort ? std::vector<AcceptTarget>{ all[0] } : all, fd))
+                    return false;
+
+                for (unsigned int i = 1; config_.reusePort && i < shardCount; ++i)
                 {
-                    io_service_.post([this, worker](){
-                        asio::spawn(io_service_, std::bind(&ProtocolClient::Start, worker, std::placeholders::_1));
-                    });
+                    int dupFd = dup(shards_[0]->ListenerHandle());
+                    if (dupFd < 0 || !shards_[i]->Listen(context_, { all[i] }, dupFd))
+                        return false;
                 }
             }
+
+            signals_.reset(new asio::signal_set(shards_[0]->IoService(), SIGTERM, SIGINT));
+            drainTimer_.reset(new asio::steady_timer(shards_[0]->IoService()));
+            WaitForSignal();
+
+            unsigned int cpuCount = std::max(1u, std::thread::hardware_concurrency());
+            if (handlerPool_)
+                handlerPool_->Run(config_.handlerThreads, -1, cpuCount);
+            for (unsigned int i = 0; i < shardCount; ++i)
+                shards_[i]->Run(threadsPerShard, config_.cpuAffinity ? (int)((i * threadsPerShard) % cpuCount) : -1, cpuCount);
+            NotifySupervisor(supervisorFd_);
+
+            for (auto& shard : shards_)
+                shard->Join();
+            if (handlerPool_)
+                handlerPool_->Join();
+            return true;
         }
     };
 };
 
-int main()
+int main(int argc, char** argv)
 {
     using namespace SoraFastCGI;
 
-    asio::io_service io_service;
+    ServerConfig config;
+    std::string error;
+    if (!ParseServerConfig(argc, argv, config, error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    StartLogger();
 
-    Acceptor acceptor(io_service);
-    asio::spawn(io_service, [&acceptor](asio::yield_context yield){
-        acceptor.Start(yield);
-    });
+    Router router;
+    AddBuiltinRoutes(router, config);
 
-    std::thread([](){ asio::io_service::work keepwork(log_service); log_service.run(); }).detach();
+    Server server(config, router);
+    if (config.workers > 0)
+    {
+        int listenFd = server.OpenListener();
+        int code = listenFd < 0 ? 1 : RunSupervisor(config, listenFd, argv);
+        StopLogger();
+        return code;
+    }
 
-    std::thread([&io_service]() { io_service.run(); }).detach();
-    std::thread([&io_service]() { io_service.run(); }).detach();
-    std::thread([&io_service]() { io_service.run(); }).detach();
-    io_service.run();
+    if (!server.Run())
+    {
+        StopLogger();
+        return 1;
+    }
+    StopLogger();
     return 0;
 }
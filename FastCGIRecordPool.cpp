@@ -0,0 +1,217 @@
+#include "SoraFastCGI.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+#include <stdlib.h>
+#include <stddef.h>
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        // Block sizes include the record header. Small covers BEGIN/END/empty
+        // terminator records and typical PARAMS, medium covers short responses,
+        // large covers anything up to the protocol maximum.
+        const unsigned int classSize[RecordPool::SizeClassCount] = { 256, 8192, max_record_len };
+
+        // Upper bound on blocks a single thread keeps around per class.
+        const unsigned int classDepth[RecordPool::SizeClassCount] = { 256, 64, 8 };
+
+        // Marks blocks that were too large for any class and came straight from malloc.
+        const unsigned int heapClass = RecordPool::SizeClassCount;
+
+        struct alignas(16) BlockHeader
+        {
+            unsigned int sizeClass;
+        };
+
+        struct FreeBlock
+        {
+            FreeBlock* next;
+        };
+
+        using Counter = std::atomic<unsigned long long>;
+
+        // Counters are only written by the owning thread, so a relaxed
+        // load/store pair is enough and avoids locked instructions.
+        inline void Bump(Counter& c)
+        {
+            c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        struct ThreadCache;
+
+        // Set when the calling thread's cache is destroyed at thread exit.
+        // Records allocated or released after that (say, by a connection
+        // torn down later in the exit) bypass the cache; a plain bool has no
+        // destructor, so it is still valid then.
+        thread_local bool cacheDestroyed = false;
+
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<ThreadCache*> caches;
+            RecordPool::Stats retired{};
+        };
+
+        Registry& GetRegistry()
+        {
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        struct ThreadCache
+        {
+            FreeBlock* freeList[RecordPool::SizeClassCount] = {};
+            unsigned int freeCount[RecordPool::SizeClassCount] = {};
+
+            Counter allocations[RecordPool::SizeClassCount] = {};
+            Counter poolHits[RecordPool::SizeClassCount] = {};
+            Counter releases[RecordPool::SizeClassCount] = {};
+            Counter heapAllocations{};
+            Counter heapFrees{};
+            Counter cachedBlocks{};
+
+            ThreadCache()
+            {
+                Registry& registry = GetRegistry();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                registry.caches.push_back(this);
+            }
+
+            ~ThreadCache()
+            {
+                cacheDestroyed = true;
+                for (int i = 0; i < RecordPool::SizeClassCount; ++i)
+                {
+                    while (freeList[i])
+                    {
+                        FreeBlock* block = freeList[i];
+                        freeList[i] = block->next;
+                        free((char*)block - sizeof(BlockHeader));
+                        Bump(heapFrees);
+                    }
+                }
+                cachedBlocks.store(0, std::memory_order_relaxed);
+
+                Registry& registry = GetRegistry();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                AddTo(registry.retired);
+                registry.caches.erase(std::find(registry.caches.begin(), registry.caches.end(), this));
+            }
+
+            void AddTo(RecordPool::Stats& stats) const
+            {
+                for (int i = 0; i < RecordPool::SizeClassCount; ++i)
+                {
+                    stats.allocations[i] += allocations[i].load(std::memory_order_relaxed);
+                    stats.poolHits[i] += poolHits[i].load(std::memory_order_relaxed);
+                    stats.releases[i] += releases[i].load(std::memory_order_relaxed);
+                }
+                stats.heapAllocations += heapAllocations.load(std::memory_order_relaxed);
+                stats.heapFrees += heapFrees.load(std::memory_order_relaxed);
+                stats.cachedBlocks += cachedBlocks.load(std::memory_order_relaxed);
+            }
+        };
+
+        ThreadCache& LocalCache()
+        {
+            thread_local ThreadCache cache;
+            return cache;
+        }
+
+        unsigned int ClassOf(unsigned int size)
+        {
+            for (unsigned int i = 0; i < RecordPool::SizeClassCount; ++i)
+            {
+                if (size <= classSize[i])
+                    return i;
+            }
+            return heapClass;
+        }
+    }
+
+    void* RecordPool::Allocate(unsigned int size)
+    {
+        if (cacheDestroyed)
+        {
+            BlockHeader* header = (BlockHeader*)malloc(sizeof(BlockHeader) + size);
+            if (!header)
+                throw std::bad_alloc();
+            header->sizeClass = heapClass;
+            return header + 1;
+        }
+
+        ThreadCache& cache = LocalCache();
+        unsigned int sizeClass = ClassOf(size);
+
+        if (sizeClass != heapClass)
+        {
+            Bump(cache.allocations[sizeClass]);
+
+            FreeBlock* block = cache.freeList[sizeClass];
+            if (block)
+            {
+                cache.freeList[sizeClass] = block->next;
+                --cache.freeCount[sizeClass];
+                cache.cachedBlocks.store(cache.cachedBlocks.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+                Bump(cache.poolHits[sizeClass]);
+                return block;
+            }
+            size = classSize[sizeClass];
+        }
+
+        BlockHeader* header = (BlockHeader*)malloc(sizeof(BlockHeader) + size);
+        if (!header)
+            throw std::bad_alloc();
+        Bump(cache.heapAllocations);
+
+        header->sizeClass = sizeClass;
+        return header + 1;
+    }
+
+    void RecordPool::Release(void* ptr)
+    {
+        BlockHeader* header = (BlockHeader*)ptr - 1;
+        if (cacheDestroyed)
+        {
+            free(header);
+            return;
+        }
+
+        ThreadCache& cache = LocalCache();
+        unsigned int sizeClass = header->sizeClass;
+
+        if (sizeClass != heapClass)
+        {
+            Bump(cache.releases[sizeClass]);
+            if (cache.freeCount[sizeClass] < classDepth[sizeClass])
+            {
+                FreeBlock* block = (FreeBlock*)ptr;
+                block->next = cache.freeList[sizeClass];
+                cache.freeList[sizeClass] = block;
+                ++cache.freeCount[sizeClass];
+                Bump(cache.cachedBlocks);
+                return;
+            }
+        }
+
+        free(header);
+        Bump(cache.heapFrees);
+    }
+
+    RecordPool::Stats RecordPool::GetStats()
+    {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        Stats stats = registry.retired;
+        for (ThreadCache* cache : registry.caches)
+            cache->AddTo(stats);
+        return stats;
+    }
+};
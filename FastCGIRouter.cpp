@@ -0,0 +1,88 @@
+#include "SoraFastCGI.h"
+
+#include <map>
+
+namespace SoraFastCGI
+{
+    struct Router::BuildNode
+    {
+        std::map<unsigned char, std::unique_ptr<BuildNode>> children;
+        IHandler* exact = nullptr;
+        IHandler* prefix = nullptr;
+    };
+
+    Router::Router()
+        : root_(new BuildNode())
+    {
+        Compile();
+    }
+
+    Router::~Router()
+    {
+    }
+
+    void Router::Add(std::string_view path, MatchKind kind, IHandler* handler)
+    {
+        BuildNode* node = root_.get();
+        for (char c : path)
+        {
+            std::unique_ptr<BuildNode>& child = node->children[(unsigned char)c];
+            if (!child)
+                child.reset(new BuildNode());
+            node = child.get();
+        }
+
+        if (kind == MatchExact)
+            node->exact = handler;
+        else
+            node->prefix = handler;
+    }
+
+    void Router::Compile()
+    {
+        nodes_.clear();
+        edges_.clear();
+
+        // Breadth first, so the children of a node sit next to each other
+        // and its edges form one sorted run.
+        std::vector<const BuildNode*> order{ root_.get() };
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            const BuildNode* build = order[i];
+            Node node;
+            node.firstEdge = (unsigned int)edges_.size();
+            node.edgeCount = (unsigned short)build->children.size();
+            node.exact = build->exact;
+            node.prefix = build->prefix;
+            nodes_.push_back(node);
+
+            for (auto& child : build->children)
+            {
+                edges_.push_back(Edge{ child.first, (unsigned int)order.size() });
+                order.push_back(child.second.get());
+            }
+        }
+    }
+
+    IHandler* Router::Find(std::string_view path) const
+    {
+        const Node* node = &nodes_[0];
+        IHandler* best = node->prefix;
+
+        for (char c : path)
+        {
+            unsigned char byte = (unsigned char)c;
+            const Edge* begin = edges_.data() + node->firstEdge;
+            const Edge* end = begin + node->edgeCount;
+            const Edge* edge = std::lower_bound(begin, end, byte, [](const Edge& e, unsigned char b) { return e.byte < b; });
+            if (edge == end || edge->byte != byte)
+                return best;
+
+            node = &nodes_[edge->child];
+            if (node->prefix)
+                best = node->prefix;
+        }
+
+        return node->exact ? node->exact : best;
+    }
+};
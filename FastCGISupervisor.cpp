@@ -0,0 +1,504 @@
+#include "SoraFastCGI.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace SoraFastCGI
+{
+    namespace
+    {
+        // Names the descriptor a worker writes to once it accepts connections.
+        const char* const readyFdVariable = "SORAFCGI_READY_FD";
+
+        // A worker that dies before it accepts, or sooner than this after it
+        // was started, is replaced only after the same delay, doubled for
+        // every such death in a row up to maxRestartDelayNs. A worker that
+        // cannot start does not turn into a fork loop.
+        const unsigned long long minLifetimeNs = 1000000000ull;
+        const unsigned long long maxRestartDelayNs = 30000000000ull;
+
+        // New workers of a reload that die this many times before accepting
+        // are given up on, and the workers they were to replace stay.
+        const unsigned int maxReloadFailures = 3;
+
+        const int handledSignals[] = { SIGCHLD, SIGHUP, SIGTERM, SIGINT };
+
+        // Write end of the pipe the signal handler reports signals through.
+        int signalPipe = -1;
+
+        void OnSignal(int signo)
+        {
+            int saved = errno;
+            unsigned char byte = (unsigned char)signo;
+            if (write(signalPipe, &byte, 1) < 0)
+            {
+                // Full pipe: enough is queued already to wake the supervisor.
+            }
+            errno = saved;
+        }
+
+        struct Child
+        {
+            pid_t pid;
+            unsigned int generation;
+            unsigned long long startNs;
+
+            // Read end of the readiness pipe until the worker reports in.
+            int readyFd;
+            bool ready;
+
+            // Sent SIGTERM, by a reload or by the supervisor stopping.
+            bool retired;
+        };
+
+        // A worker to start in place of one that died.
+        struct Restart
+        {
+            unsigned long long at;
+            unsigned int generation;
+        };
+
+        class Supervisor
+        {
+            const ServerConfig& config_;
+            int listenFd_;
+
+            // Command line of the workers: the supervisor's own, told to
+            // serve the inherited socket in a single process.
+            std::vector<std::string> args_;
+
+            // Absolute path of the binary, so the child needs no PATH search.
+            std::string exe_;
+
+            int signalRead_;
+
+            // Workers of older generations are retired once the current
+            // one is fully up.
+            unsigned int generation_;
+            std::vector<Child> children_;
+            std::vector<Restart> restarts_;
+
+            // Workers in a row that died before they were up, and those of
+            // them that belonged to a reload still replacing older workers.
+            unsigned int failures_;
+            unsigned int reloadFailures_;
+
+            bool stopping_;
+
+        public:
+            Supervisor(const ServerConfig& config, int listenFd, char** argv)
+                : config_(config)
+                , listenFd_(listenFd)
+                , signalRead_(-1)
+                , generation_{}
+                , failures_{}
+                , reloadFailures_{}
+                , stopping_{}
+            {
+                for (char** arg = argv; *arg; ++arg)
+                    args_.push_back(*arg);
+                args_.push_back("--workers=0");
+                args_.push_back("--transport=inherit");
+
+                // Read before any reload can replace the file, which would
+                // make the link read "<path> (deleted)".
+                char path[PATH_MAX];
+                ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+                exe_ = len > 0 ? std::string(path, len) : args_[0];
+            }
+
+            int Run()
+            {
+                int fds[2];
+                if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0)
+                {
+                    LogOutput(LogError) << "fail to create signal pipe : " << strerror(errno);
+                    return 1;
+                }
+                signalRead_ = fds[0];
+                signalPipe = fds[1];
+
+                // Handlers rather than a blocked mask: the logger thread is
+                // already running and would take the signals otherwise.
+                struct sigaction action;
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = OnSignal;
+                action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+                sigemptyset(&action.sa_mask);
+                for (int signo : handledSignals)
+                    sigaction(signo, &action, nullptr);
+
+                LogOutput(LogInfo) << "supervising " << config_.workers << " workers";
+                for (unsigned int i = 0; i < config_.workers; ++i)
+                    StartWorker(generation_);
+
+                while (!stopping_ || !children_.empty())
+                {
+                    std::vector<pollfd> polled;
+                    polled.push_back(pollfd{ signalRead_, POLLIN, 0 });
+                    for (const Child& child : children_)
+                    {
+                        if (child.readyFd >= 0)
+                            polled.push_back(pollfd{ child.readyFd, POLLIN, 0 });
+                    }
+
+                    int timeout = -1;
+                    if (!restarts_.empty())
+                    {
+                        unsigned long long now = Metrics::Now();
+                        unsigned long long due = std::min_element(restarts_.begin(), restarts_.end(), [](const Restart& a, const Restart& b) {
+                            return a.at < b.at;
+                        })->at;
+                        timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+                    }
+
+                    if (poll(polled.data(), polled.size(), timeout) < 0 && errno != EINTR)
+                    {
+                        LogOutput(LogError) << "fail to poll : " << strerror(errno);
+                        return 1;
+                    }
+
+                    for (std::size_t i = 1; i < polled.size(); ++i)
+                    {
+                        if (polled[i].revents)
+                            ReadyEvent(polled[i].fd);
+                    }
+                    if (polled[0].revents)
+                        HandleSignals();
+                    StartDue();
+                }
+
+                LogOutput(LogInfo) << "all workers exited";
+                return 0;
+            }
+
+        private:
+            void StartWorker(unsigned int generation)
+            {
+                int ready[2];
+                if (pipe2(ready, O_CLOEXEC) != 0)
+                {
+                    LogOutput(LogError) << "fail to create readiness pipe : " << strerror(errno);
+                    restarts_.push_back(Restart{ Metrics::Now() + minLifetimeNs, generation });
+                    return;
+                }
+
+                // Everything the child needs is built here: between fork and
+                // exec only async-signal-safe calls are allowed.
+                std::vector<char*> argv;
+                for (std::string& arg : args_)
+                    argv.push_back(&arg[0]);
+                argv.push_back(nullptr);
+
+                std::string readyVariable = std::string(readyFdVariable) + "=" + std::to_string(ready[1]);
+                std::vector<char*> envp;
+                for (char** env = environ; *env; ++env)
+                {
+                    if (strncmp(*env, readyFdVariable, strlen(readyFdVariable)) != 0)
+                        envp.push_back(*env);
+                }
+                envp.push_back(&readyVariable[0]);
+                envp.push_back(nullptr);
+
+                // Blocked across the fork so the child cannot run the
+                // supervisor's handler before it resets the dispositions.
+                sigset_t all, previous;
+                sigfillset(&all);
+                sigprocmask(SIG_BLOCK, &all, &previous);
+
+                pid_t parent = getpid();
+                pid_t pid = fork();
+                if (pid == 0)
+                {
+                    for (int signo : handledSignals)
+                        signal(signo, SIG_DFL);
+                    // Only the supervisor reloads, and a Ctrl-C meant for it
+                    // must not reach the workers past its drain; they go
+                    // when it does, however it goes.
+                    signal(SIGHUP, SIG_IGN);
+                    setpgid(0, 0);
+                    prctl(PR_SET_PDEATHSIG, SIGTERM);
+                    // The supervisor may have died before prctl took effect.
+                    if (getppid() != parent)
+                        _exit(1);
+                    sigprocmask(SIG_SETMASK, &previous, nullptr);
+
+                    if (listenFd_ == FCGI_LISTENSOCK_FILENO)
+                        fcntl(listenFd_, F_SETFD, 0);
+                    else
+                        dup2(listenFd_, FCGI_LISTENSOCK_FILENO);
+                    fcntl(ready[1], F_SETFD, 0);
+
+                    execve(exe_.c_str(), argv.data(), envp.data());
+                    _exit(127);
+                }
+                int forkError = errno;
+                sigprocmask(SIG_SETMASK, &previous, nullptr);
+                close(ready[1]);
+
+                if (pid < 0)
+                {
+                    LogOutput(LogError) << "fail to fork worker : " << strerror(forkError);
+                    close(ready[0]);
+                    restarts_.push_back(Restart{ Metrics::Now() + minLifetimeNs, generation });
+                    return;
+                }
+
+                children_.push_back(Child{ pid, generation, Metrics::Now(), ready[0], false, false });
+            }
+
+            // The worker wrote its byte, or closed the pipe by exiting first.
+            void ReadyEvent(int fd)
+            {
+                auto it = std::find_if(children_.begin(), children_.end(), [fd](const Child& child) {
+                    return child.readyFd == fd;
+                });
+                if (it == children_.end())
+                    return;
+
+                char byte;
+                it->ready = read(fd, &byte, 1) == 1;
+                close(fd);
+                it->readyFd = -1;
+                if (!it->ready)
+                    return;
+
+                LogOutput(LogInfo) << "worker " << it->pid << " accepting after "
+                    << (Metrics::Now() - it->startNs) / 1000000 << " ms";
+                RetireIfReplaced();
+            }
+
+            unsigned int ReadyCount(unsigned int generation) const
+            {
+                unsigned int ready = 0;
+                for (const Child& child : children_)
+                {
+                    if (child.generation == generation && child.ready && !child.retired)
+                        ++ready;
+                }
+                return ready;
+            }
+
+            // Newest generation before the current one that still has
+            // workers, or workers due to be restarted; -1 if there is none.
+            long long PreviousGeneration() const
+            {
+                long long previous = -1;
+                for (const Child& child : children_)
+                {
+                    if (!child.retired && child.generation < generation_)
+                        previous = std::max(previous, (long long)child.generation);
+                }
+                for (const Restart& restart : restarts_)
+                {
+                    if (restart.generation < generation_)
+                        previous = std::max(previous, (long long)restart.generation);
+                }
+                return previous;
+            }
+
+            // Once every worker of the current generation accepts, the older
+            // ones are told to drain. Until then they keep serving, and are
+            // restarted if they die, so a reload to a build that does not
+            // start loses nothing.
+            void RetireIfReplaced()
+            {
+                if (ReadyCount(generation_) < config_.workers)
+                    return;
+
+                for (Child& child : children_)
+                {
+                    if (child.generation != generation_ && !child.retired)
+                    {
+                        LogOutput(LogInfo) << "retiring worker " << child.pid;
+                        child.retired = true;
+                        kill(child.pid, SIGTERM);
+                    }
+                }
+            }
+
+            void HandleSignals()
+            {
+                unsigned char signals[64];
+                ssize_t count;
+                while ((count = read(signalRead_, signals, sizeof(signals))) > 0)
+                {
+                    for (ssize_t i = 0; i < count; ++i)
+                    {
+                        if (signals[i] == SIGCHLD)
+                            Reap();
+                        else if (signals[i] == SIGHUP)
+                            Reload();
+                        else
+                            Stop();
+                    }
+                }
+            }
+
+            void Reap()
+            {
+                int status;
+                pid_t pid;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+                {
+                    auto it = std::find_if(children_.begin(), children_.end(), [pid](const Child& child) {
+                        return child.pid == pid;
+                    });
+                    if (it == children_.end())
+                        continue;
+
+                    std::string how = WIFSIGNALED(status) ? "killed by signal " + std::to_string(WTERMSIG(status))
+                        : "exited with status " + std::to_string(WEXITSTATUS(status));
+                    if (it->retired)
+                        LogOutput(LogInfo) << "worker " << pid << " " << how;
+                    else
+                        LogOutput(LogError) << "worker " << pid << " " << how;
+
+                    Child child = *it;
+                    if (child.readyFd >= 0)
+                        close(child.readyFd);
+                    children_.erase(it);
+                    if (stopping_ || child.retired)
+                        continue;
+
+                    unsigned long long now = Metrics::Now();
+                    bool failed = !child.ready || now - child.startNs < minLifetimeNs;
+                    failures_ = failed ? failures_ + 1 : 0;
+                    if (failed && child.generation == generation_ && PreviousGeneration() >= 0
+                        && ++reloadFailures_ >= maxReloadFailures)
+                    {
+                        AbandonReload();
+                        continue;
+                    }
+
+                    unsigned long long delay = 0;
+                    if (failed)
+                    {
+                        delay = minLifetimeNs;
+                        for (unsigned int i = 1; i < failures_ && delay < maxRestartDelayNs; ++i)
+                            delay *= 2;
+                        delay = std::min(delay, maxRestartDelayNs);
+                        LogOutput(LogWarning) << "restarting in " << delay / 1000000
+                            << " ms, failed starts in a row: " << failures_;
+                    }
+                    restarts_.push_back(Restart{ now + delay, child.generation });
+                }
+            }
+
+            // The new workers of a reload keep dying before they accept:
+            // they are stopped and the generation they were to replace
+            // becomes the current one again.
+            void AbandonReload()
+            {
+                unsigned int failed = generation_;
+                generation_ = (unsigned int)PreviousGeneration();
+                reloadFailures_ = 0;
+                LogOutput(LogError) << "reload failed, new workers died " << maxReloadFailures
+                    << " times before accepting; keeping the running ones";
+
+                restarts_.erase(std::remove_if(restarts_.begin(), restarts_.end(), [failed](const Restart& restart) {
+                    return restart.generation == failed;
+                }), restarts_.end());
+                for (Child& child : children_)
+                {
+                    if (child.generation == failed && !child.retired)
+                    {
+                        child.retired = true;
+                        kill(child.pid, SIGTERM);
+                    }
+                }
+                RetireIfReplaced();
+            }
+
+            // Starts a full set of workers from the binary as it is now on
+            // disk; the listening socket stays open throughout.
+            void Reload()
+            {
+                if (stopping_)
+                    return;
+                // A new build gets a fresh start; restarts already due for
+                // the running workers still happen until it is up.
+                ++generation_;
+                failures_ = 0;
+                reloadFailures_ = 0;
+                LogOutput(LogInfo) << "reloading, starting " << config_.workers << " new workers";
+                for (unsigned int i = 0; i < config_.workers; ++i)
+                    StartWorker(generation_);
+            }
+
+            // The first request drains the workers, a second one kills them.
+            void Stop()
+            {
+                int signo = stopping_ ? SIGKILL : SIGTERM;
+                LogOutput(LogInfo) << (stopping_ ? "killing" : "stopping") << " " << children_.size() << " workers";
+                stopping_ = true;
+                restarts_.clear();
+                for (Child& child : children_)
+                {
+                    child.retired = true;
+                    kill(child.pid, signo);
+                }
+            }
+
+            // Workers of an older generation are only restarted while the
+            // current one is not fully up; they would be retired at once.
+            void StartDue()
+            {
+                unsigned long long now = Metrics::Now();
+                auto due = std::partition(restarts_.begin(), restarts_.end(), [now](const Restart& restart) {
+                    return restart.at > now;
+                });
+                std::vector<Restart> starting(due, restarts_.end());
+                restarts_.erase(due, restarts_.end());
+                bool replaced = ReadyCount(generation_) >= config_.workers;
+                for (const Restart& restart : starting)
+                {
+                    if (restart.generation == generation_ || !replaced)
+                        StartWorker(restart.generation);
+                }
+            }
+        };
+    }
+
+    int RunSupervisor(const ServerConfig& config, int listenFd, char** argv)
+    {
+        Supervisor supervisor(config, listenFd, argv);
+        return supervisor.Run();
+    }
+
+    int TakeSupervisorFd()
+    {
+        const char* value = getenv(readyFdVariable);
+        if (!value)
+            return -1;
+
+        int fd = atoi(value);
+        unsetenv(readyFdVariable);
+        return fd;
+    }
+
+    void NotifySupervisor(int fd)
+    {
+        if (fd < 0)
+            return;
+
+        char byte = 1;
+        if (write(fd, &byte, 1) != 1)
+            LogOutput(LogWarning) << "fail to notify supervisor : " << strerror(errno);
+        close(fd);
+    }
+};
@@ -0,0 +1,385 @@
+#include "SoraFastCGI.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// Builds against the kernel header alone; liburing is not needed.
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define SORA_FCGI_HAS_URING 1
+#endif
+
+namespace SoraFastCGI
+{
+#ifdef SORA_FCGI_HAS_URING
+    namespace
+    {
+        int SetupRing(unsigned int entries, io_uring_params& params)
+        {
+            return (int)syscall(__NR_io_uring_setup, entries, &params);
+        }
+
+        int EnterRing(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+        {
+            return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+        }
+
+        int RegisterRing(int fd, unsigned int opcode, void* arg, unsigned int count)
+        {
+            return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+        }
+
+        template<class T>
+        T* At(void* base, unsigned int offset)
+        {
+            return (T*)((char*)base + offset);
+        }
+
+        std::string SystemError(const char* what)
+        {
+            return std::string(what) + " : " + strerror(errno);
+        }
+    }
+
+    // Both rings share one mapping (IORING_FEAT_SINGLE_MMAP). Head and tail
+    // indices are shared with the kernel and accessed with acquire/release.
+    struct UringQueue::Ring
+    {
+        int fd = -1;
+        int eventFd = -1;
+
+        void* rings = MAP_FAILED;
+        std::size_t ringsLen = 0;
+        io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+        std::size_t sqesLen = 0;
+
+        unsigned int* sqHead = nullptr;
+        unsigned int* sqTail = nullptr;
+        unsigned int* sqFlags = nullptr;
+        unsigned int sqMask = 0;
+        unsigned int sqEntries = 0;
+
+        // Entries queued but not yet published to the kernel.
+        unsigned int sqLocalTail = 0;
+
+        unsigned int* cqHead = nullptr;
+        unsigned int* cqTail = nullptr;
+        unsigned int cqMask = 0;
+        io_uring_cqe* cqes = nullptr;
+
+        char* bufMemory = (char*)MAP_FAILED;
+        std::size_t bufMemoryLen = 0;
+        unsigned int bufCount = 0;
+        unsigned int bufSize = 0;
+
+        ~Ring()
+        {
+            if (fd >= 0)
+                close(fd);
+            if (eventFd >= 0)
+                close(eventFd);
+            if (rings != MAP_FAILED)
+                munmap(rings, ringsLen);
+            if (sqes != MAP_FAILED)
+                munmap(sqes, sqesLen);
+            if (bufMemory != MAP_FAILED)
+                munmap(bufMemory, bufMemoryLen);
+        }
+
+        io_uring_sqe* NextSqe()
+        {
+            if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+                return nullptr;
+            io_uring_sqe* sqe = &sqes[sqLocalTail & sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            ++sqLocalTail;
+            return sqe;
+        }
+
+        // Hands buffers [first, first + count) back to group 0. Only a
+        // failure posts a completion, and it carries userData 0.
+        bool ProvideBuffers(unsigned int first, unsigned int count)
+        {
+            io_uring_sqe* sqe = NextSqe();
+            if (!sqe)
+                return false;
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = (int)count;
+            sqe->addr = (unsigned long long)(bufMemory + (std::size_t)first * bufSize);
+            sqe->len = bufSize;
+            sqe->off = first;
+            sqe->buf_group = 0;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            return true;
+        }
+    };
+
+    UringQueue::UringQueue()
+    {
+    }
+
+    UringQueue::~UringQueue()
+    {
+    }
+
+    bool UringQueue::Init(unsigned int entries, unsigned int bufferCount, unsigned int bufferSize, std::string& error)
+    {
+        if (bufferCount == 0 || bufferCount > 65536 || bufferSize == 0)
+        {
+            error = "buffer count must be between 1 and 65536";
+            return false;
+        }
+
+        std::unique_ptr<Ring> ring(new Ring());
+
+        // Multishot operations post many completions per submission, so the
+        // completion queue gets more room than the default twice the entries.
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring->fd = SetupRing(entries, params);
+        if (ring->fd < 0)
+        {
+            error = SystemError("io_uring_setup");
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+        {
+            error = "kernel too old for io_uring";
+            return false;
+        }
+
+        ring->ringsLen = std::max<std::size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring->rings = mmap(nullptr, ring->ringsLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->rings == MAP_FAILED)
+        {
+            error = SystemError("mmap io_uring rings");
+            return false;
+        }
+        ring->sqesLen = params.sq_entries * sizeof(io_uring_sqe);
+        ring->sqes = (io_uring_sqe*)mmap(nullptr, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+        {
+            error = SystemError("mmap io_uring entries");
+            return false;
+        }
+
+        ring->sqHead = At<unsigned int>(ring->rings, params.sq_off.head);
+        ring->sqTail = At<unsigned int>(ring->rings, params.sq_off.tail);
+        ring->sqFlags = At<unsigned int>(ring->rings, params.sq_off.flags);
+        ring->sqMask = *At<unsigned int>(ring->rings, params.sq_off.ring_mask);
+        ring->sqEntries = *At<unsigned int>(ring->rings, params.sq_off.ring_entries);
+        ring->sqLocalTail = *ring->sqTail;
+        ring->cqHead = At<unsigned int>(ring->rings, params.cq_off.head);
+        ring->cqTail = At<unsigned int>(ring->rings, params.cq_off.tail);
+        ring->cqMask = *At<unsigned int>(ring->rings, params.cq_off.ring_mask);
+        ring->cqes = At<io_uring_cqe>(ring->rings, params.cq_off.cqes);
+
+        // Slot i of the submission ring always names entry i.
+        unsigned int* sqArray = At<unsigned int>(ring->rings, params.sq_off.array);
+        for (unsigned int i = 0; i < ring->sqEntries; ++i)
+            sqArray[i] = i;
+
+        ring->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (ring->eventFd < 0 || RegisterRing(ring->fd, IORING_REGISTER_EVENTFD, &ring->eventFd, 1) < 0)
+        {
+            error = SystemError("io_uring eventfd");
+            return false;
+        }
+
+        // Buffers go to the kernel with PROVIDE_BUFFERS rather than a
+        // registered buffer ring, which fails every selection with ENOBUFS on
+        // some kernels; a recycled buffer rides along with the next Submit.
+        ring->bufCount = bufferCount;
+        ring->bufSize = bufferSize;
+        ring->bufMemoryLen = (std::size_t)bufferCount * bufferSize;
+        ring->bufMemory = (char*)mmap(nullptr, ring->bufMemoryLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring->bufMemory == MAP_FAILED)
+        {
+            error = SystemError("mmap receive buffers");
+            return false;
+        }
+
+        ring_ = std::move(ring);
+        if (!ring_->ProvideBuffers(0, bufferCount) || !Submit())
+        {
+            error = SystemError("io_uring provided buffers");
+            ring_.reset();
+            return false;
+        }
+        return true;
+    }
+
+    int UringQueue::EventFd() const
+    {
+        return ring_->eventFd;
+    }
+
+    unsigned int UringQueue::Space() const
+    {
+        return ring_->sqEntries - (ring_->sqLocalTail - __atomic_load_n(ring_->sqHead, __ATOMIC_ACQUIRE));
+    }
+
+    bool UringQueue::Accept(int fd, unsigned long long userData)
+    {
+        io_uring_sqe* sqe = ring_->NextSqe();
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool UringQueue::Recv(int fd, unsigned long long userData)
+    {
+        io_uring_sqe* sqe = ring_->NextSqe();
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool UringQueue::SendMsg(int fd, const msghdr* msg, bool link, unsigned long long userData)
+    {
+        io_uring_sqe* sqe = ring_->NextSqe();
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long long)msg;
+        sqe->len = 1;
+        // MSG_WAITALL makes the kernel retry short sends itself, so a
+        // completion short of the full length only comes with an error.
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (link)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool UringQueue::Cancel(unsigned long long target)
+    {
+        io_uring_sqe* sqe = ring_->NextSqe();
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = 0;
+        return true;
+    }
+
+    bool UringQueue::Submit()
+    {
+        // Counted from the kernel's head, so entries left by a failed call go too.
+        __atomic_store_n(ring_->sqTail, ring_->sqLocalTail, __ATOMIC_RELEASE);
+        unsigned int pending = ring_->sqLocalTail - __atomic_load_n(ring_->sqHead, __ATOMIC_ACQUIRE);
+        while (pending > 0)
+        {
+            int submitted = EnterRing(ring_->fd, pending, 0, 0);
+            if (submitted < 0 && errno == EINTR)
+                continue;
+            if (submitted <= 0)
+                return false;
+            pending -= submitted;
+        }
+        return true;
+    }
+
+    unsigned int UringQueue::Reap(Completion* out, unsigned int max)
+    {
+        for (;;)
+        {
+            unsigned int head = *ring_->cqHead;
+            unsigned int tail = __atomic_load_n(ring_->cqTail, __ATOMIC_ACQUIRE);
+            unsigned int count = 0;
+            while (head != tail && count < max)
+            {
+                const io_uring_cqe& cqe = ring_->cqes[head & ring_->cqMask];
+                out[count++] = Completion{ cqe.user_data, cqe.res, cqe.flags };
+                ++head;
+            }
+            __atomic_store_n(ring_->cqHead, head, __ATOMIC_RELEASE);
+
+            // Completions that did not fit are kept by the kernel until asked for.
+            if (count > 0 || !(__atomic_load_n(ring_->sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+                return count;
+            EnterRing(ring_->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        }
+    }
+
+    bool UringQueue::Ready() const
+    {
+        return *ring_->cqHead != __atomic_load_n(ring_->cqTail, __ATOMIC_ACQUIRE)
+            || (__atomic_load_n(ring_->sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW);
+    }
+
+    bool UringQueue::HasMore(unsigned int flags)
+    {
+        return (flags & IORING_CQE_F_MORE) != 0;
+    }
+
+    int UringQueue::BufferId(unsigned int flags)
+    {
+        return (flags & IORING_CQE_F_BUFFER) ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    }
+
+    const char* UringQueue::Buffer(int id) const
+    {
+        return ring_->bufMemory + (std::size_t)id * ring_->bufSize;
+    }
+
+    void UringQueue::RecycleBuffer(int id)
+    {
+        if (!ring_->ProvideBuffers(id, 1) && Submit())
+            ring_->ProvideBuffers(id, 1);
+    }
+#else
+    struct UringQueue::Ring
+    {
+    };
+
+    UringQueue::UringQueue()
+    {
+    }
+
+    UringQueue::~UringQueue()
+    {
+    }
+
+    bool UringQueue::Init(unsigned int entries, unsigned int bufferCount, unsigned int bufferSize, std::string& error)
+    {
+        error = "built without io_uring support";
+        return false;
+    }
+
+    int UringQueue::EventFd() const { return -1; }
+    unsigned int UringQueue::Space() const { return 0; }
+    bool UringQueue::Accept(int fd, unsigned long long userData) { return false; }
+    bool UringQueue::Recv(int fd, unsigned long long userData) { return false; }
+    bool UringQueue::SendMsg(int fd, const msghdr* msg, bool link, unsigned long long userData) { return false; }
+    bool UringQueue::Cancel(unsigned long long target) { return false; }
+    bool UringQueue::Submit() { return false; }
+    unsigned int UringQueue::Reap(Completion* out, unsigned int max) { return 0; }
+    bool UringQueue::Ready() const { return false; }
+    bool UringQueue::HasMore(unsigned int flags) { return false; }
+    int UringQueue::BufferId(unsigned int flags) { return -1; }
+    const char* UringQueue::Buffer(int id) const { return nullptr; }
+    void UringQueue::RecycleBuffer(int id) {}
+#endif
+};
@@ -1,5 +1,7 @@
 #include "SoraFastCGI.h"
 
+#include <stdlib.h>
+
 namespace SoraFastCGI
 {
     const char* ReadKeyValuePair(const char* beginPtr, std::string& key, std::string& value)
@@ -11,7 +13,7 @@ namespace SoraFastCGI
         const FCGI_NameValuePair44* p44 = (const FCGI_NameValuePair44*)beginPtr;
         const char* bodyPtr = 0;
 
-        if ((p11->nameLengthB0 >> 7) == 0 && (p11->nameLengthB0 >> 7) == 0)
+        if ((p11->nameLengthB0 >> 7) == 0 && (p11->valueLengthB0 >> 7) == 0)
         {
             nameLen = p11->nameLengthB0;
             valueLen = p11->valueLengthB0;
@@ -73,4 +75,157 @@ namespace SoraFastCGI
 
         return bodyPtr;
     }
+
+    const char* ReadKeyValueLengths(const char* beginPtr, const char* endPtr, unsigned int& nameLen, unsigned int& valueLen)
+    {
+        const unsigned char* p = (const unsigned char*)beginPtr;
+        const unsigned char* e = (const unsigned char*)endPtr;
+
+        unsigned int* lens[2] = { &nameLen, &valueLen };
+        for (unsigned int* len : lens)
+        {
+            if (p >= e)
+                return nullptr;
+            if ((*p >> 7) == 0)
+            {
+                *len = *p++;
+            }
+            else
+            {
+                if (e - p < 4)
+                    return nullptr;
+                *len = ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+                p += 4;
+            }
+        }
+
+        if ((unsigned long long)(e - p) < (unsigned long long)nameLen + valueLen)
+            return nullptr;
+
+        return (const char*)p;
+    }
+
+    void AppendKeyValuePair(std::string& out, std::string_view name, std::string_view value)
+    {
+        for (std::size_t len : { name.size(), value.size() })
+        {
+            if (len < 0x80)
+            {
+                out.push_back((char)len);
+            }
+            else
+            {
+                out.push_back((char)((len >> 24) | 0x80));
+                out.push_back((char)((len >> 16) & 0xff));
+                out.push_back((char)((len >> 8) & 0xff));
+                out.push_back((char)(len & 0xff));
+            }
+        }
+        out.append(name.data(), name.size());
+        out.append(value.data(), value.size());
+    }
+
+    namespace
+    {
+        bool ParseValue(const std::string& text, unsigned int& value)
+        {
+            char* end = nullptr;
+            unsigned long parsed = strtoul(text.c_str(), &end, 10);
+            if (text.empty() || *end != 0 || parsed > 0xffffffffUL)
+                return false;
+            value = (unsigned int)parsed;
+            return true;
+        }
+
+        bool ParseValue(const std::string& text, bool& value)
+        {
+            if (text == "1" || text == "true" || text == "on")
+                value = true;
+            else if (text == "0" || text == "false" || text == "off")
+                value = false;
+            else
+                return false;
+            return true;
+        }
+
+        bool ParseValue(const std::string& text, std::string& value)
+        {
+            value = text;
+            return true;
+        }
+
+        bool SetConfigOption(ServerConfig& config, const std::string& name, const std::string& value, bool& known)
+        {
+            known = true;
+#define SORA_FCGI_CONFIG_OPTION(field) if (name == #field) return ParseValue(value, config.field);
+            SORA_FCGI_CONFIG_OPTION(transport)
+            SORA_FCGI_CONFIG_OPTION(address)
+            SORA_FCGI_CONFIG_OPTION(port)
+            SORA_FCGI_CONFIG_OPTION(unixPath)
+            SORA_FCGI_CONFIG_OPTION(backlog)
+            SORA_FCGI_CONFIG_OPTION(shards)
+            SORA_FCGI_CONFIG_OPTION(threadsPerShard)
+            SORA_FCGI_CONFIG_OPTION(cpuAffinity)
+            SORA_FCGI_CONFIG_OPTION(reusePort)
+            SORA_FCGI_CONFIG_OPTION(workers)
+            SORA_FCGI_CONFIG_OPTION(drainTimeout)
+            SORA_FCGI_CONFIG_OPTION(handlerThreads)
+            SORA_FCGI_CONFIG_OPTION(readQuantum)
+            SORA_FCGI_CONFIG_OPTION(bulkRequestBytes)
+            SORA_FCGI_CONFIG_OPTION(lowPriorityShare)
+            SORA_FCGI_CONFIG_OPTION(coroutines)
+            SORA_FCGI_CONFIG_OPTION(io)
+            SORA_FCGI_CONFIG_OPTION(uringBuffers)
+            SORA_FCGI_CONFIG_OPTION(uringBufferSize)
+            SORA_FCGI_CONFIG_OPTION(maxConnections)
+            SORA_FCGI_CONFIG_OPTION(idleTimeout)
+            SORA_FCGI_CONFIG_OPTION(readTimeout)
+            SORA_FCGI_CONFIG_OPTION(writeTimeout)
+            SORA_FCGI_CONFIG_OPTION(requestTimeout)
+            SORA_FCGI_CONFIG_OPTION(maxRequests)
+            SORA_FCGI_CONFIG_OPTION(maxQueuedBytes)
+            SORA_FCGI_CONFIG_OPTION(shedTarget)
+            SORA_FCGI_CONFIG_OPTION(shedInterval)
+            SORA_FCGI_CONFIG_OPTION(overloadResponse)
+            SORA_FCGI_CONFIG_OPTION(multiplex)
+            SORA_FCGI_CONFIG_OPTION(bodyMode)
+            SORA_FCGI_CONFIG_OPTION(bodyMemoryLimit)
+            SORA_FCGI_CONFIG_OPTION(tempDir)
+            SORA_FCGI_CONFIG_OPTION(bodyStreamWindow)
+            SORA_FCGI_CONFIG_OPTION(documentRoot)
+            SORA_FCGI_CONFIG_OPTION(statsPath)
+            SORA_FCGI_CONFIG_OPTION(cacheTtl)
+            SORA_FCGI_CONFIG_OPTION(cacheKeyParams)
+            SORA_FCGI_CONFIG_OPTION(cacheBytes)
+            SORA_FCGI_CONFIG_OPTION(outputHighWater)
+#undef SORA_FCGI_CONFIG_OPTION
+            known = false;
+            return false;
+        }
+    }
+
+    bool ParseServerConfig(int argc, char** argv, ServerConfig& config, std::string& error)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                error = "unexpected argument " + arg;
+                return false;
+            }
+
+            std::string::size_type eq = arg.find('=');
+            std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+            std::string value = eq == std::string::npos ? "1" : arg.substr(eq + 1);
+
+            bool known;
+            if (!SetConfigOption(config, name, value, known))
+            {
+                error = known ? "invalid value for --" + name + " : " + value : "unknown option --" + name;
+                return false;
+            }
+        }
+        return true;
+    }
 };
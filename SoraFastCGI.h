@@ -3,8 +3,18 @@
 
 #include "FastCGI.h"
 
+#include <algorithm>
+#include <functional>
 #include <memory>
+#include <new>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+
+struct msghdr;
 
 namespace SoraFastCGI
 {
@@ -12,22 +22,22 @@ namespace SoraFastCGI
 
     struct SoraFCGIHeader : FCGI_Header
     {
-        unsigned int TotalLength()
+        unsigned int TotalLength() const
         {
             return BodyLength() + sizeof(*this);
         }
 
-        unsigned int BodyLength()
+        unsigned int BodyLength() const
         {
             return ContentLength() + PaddingLength();
         }
 
-        unsigned char PaddingLength()
+        unsigned char PaddingLength() const
         {
             return paddingLength;
         }
 
-        unsigned short ContentLength()
+        unsigned short ContentLength() const
         {
             return (contentLengthB1 << 8) | contentLengthB0;
         }
@@ -38,7 +48,7 @@ namespace SoraFastCGI
             contentLengthB0 = len & 0xff;
         }
 
-        unsigned short RequestId()
+        unsigned short RequestId() const
         {
             return (requestIdB1 << 8) | requestIdB0;
         }
@@ -50,23 +60,215 @@ namespace SoraFastCGI
         }
     };
 
+    struct ServerConfig
+    {
+        // Where to listen: "tcp", "unix", "inherit" (an already listening
+        // socket on FCGI_LISTENSOCK_FILENO, as spawn-fcgi provides) or "auto",
+        // which inherits when fd 0 is a listening socket and uses tcp otherwise.
+        std::string transport = "auto";
+
+        // TCP address (IPv4 or IPv6) and port.
+        std::string address = "0.0.0.0";
+        unsigned int port = 6666;
+
+        // Path of the Unix domain socket; a stale socket file is replaced.
+        std::string unixPath = "/tmp/sorafastcgi.sock";
+
+        unsigned int backlog = ushort_max;
+
+        // Number of independent io_service shards; 0 means one per hardware thread.
+        unsigned int shards = 0;
+
+        // Threads running each shard's io_service. With more than one, a
+        // connection may move between the threads of its shard, never across shards.
+        unsigned int threadsPerShard = 1;
+
+        // Pin shard threads to CPUs, shard i starting at CPU i * threadsPerShard.
+        bool cpuAffinity = false;
+
+        // Give every shard its own acceptor so connections spread without a
+        // hand-off: TCP shards bind separate sockets with SO_REUSEPORT, Unix
+        // and inherited listeners are shared by all shards. Otherwise one
+        // acceptor deals accepted sockets to the shards round-robin.
+        bool reusePort = true;
+
+        // Worker processes run by a supervisor that owns the listening
+        // socket and restarts workers that die; 0 serves from this process.
+        // On SIGHUP the supervisor starts workers from the binary on disk
+        // and retires the old ones once all new ones accept connections.
+        unsigned int workers = 0;
+
+        // Seconds a process told to stop (SIGTERM, or retired by a reload)
+        // lets its connections finish what they have in progress before it
+        // exits regardless.
+        unsigned int drainTimeout = 30;
+
+        // Threads in a separate pool that runs request handlers. With 0,
+        // handlers run on the io_service of the connection's shard; either
+        // way the connection keeps reading while they run.
+        unsigned int handlerThreads = 0;
+
+        // Bytes of records one connection dispatches before it lets the
+        // other connections of its shard take a turn.
+        unsigned int readQuantum = 128 * 1024;
+
+        // Requests with a body at least this large run in PriorityBulk.
+        unsigned int bulkRequestBytes = 256 * 1024;
+
+        // One handler run in this many goes to the least urgent class that
+        // is waiting, so it is not starved; 0 serves classes strictly.
+        unsigned int lowPriorityShare = 8;
+
+        // How each connection's reading loop runs: "stackful" (asio::spawn,
+        // a machine stack per connection) or "stackless" (C++20 awaitable,
+        // only in builds compiled as C++20).
+        std::string coroutines = "stackful";
+
+        // How sockets are accepted, read and written: "epoll" (the asio
+        // reactor) or "uring" (io_uring with multishot accept and receive,
+        // needs Linux 6.0 or later).
+        std::string io = "epoll";
+
+        // Receive buffers each shard hands to io_uring and their size in
+        // bytes. Only used with io=uring.
+        unsigned int uringBuffers = 256;
+        unsigned int uringBufferSize = 16 * 1024;
+
+        // Connections the front-end may open, advertised as FCGI_MAX_CONNS.
+        // Connections past it are closed as soon as they are accepted.
+        unsigned int maxConnections = 10000;
+
+        // Seconds a connection may sit with no request in progress before
+        // it is closed; 0 keeps idle connections open.
+        unsigned int idleTimeout = 300;
+
+        // Seconds a request may go without any of its records arriving, and
+        // a response without the peer taking any of it, before the
+        // connection is dropped; 0 waits forever.
+        unsigned int readTimeout = 60;
+        unsigned int writeTimeout = 60;
+
+        // Seconds from BEGIN_REQUEST until the request is cancelled and
+        // answered with 504 if the handler has not sent anything yet; 0 off.
+        unsigned int requestTimeout = 0;
+
+        // Requests in flight across the process, advertised as FCGI_MAX_REQS.
+        // Further BEGIN_REQUESTs are answered with FCGI_OVERLOADED.
+        unsigned int maxRequests = 10000;
+
+        // Request bodies and unsent responses held in memory across the
+        // process; new requests are refused with FCGI_OVERLOADED beyond this.
+        unsigned int maxQueuedBytes = 256 * 1024 * 1024;
+
+        // Milliseconds a request may wait between its last STDIN record and
+        // its handler starting. When even the shortest wait seen over a
+        // shedInterval stays above this, new requests are refused with
+        // FCGI_OVERLOADED until the queue has drained; 0 never sheds.
+        unsigned int shedTarget = 0;
+        unsigned int shedInterval = 100;
+
+        // If set, requests refused for overload get a 503 with this body
+        // instead of a bare FCGI_OVERLOADED, which nginx reports as a 502.
+        std::string overloadResponse;
+
+        // Serve several requests at once on one connection (FCGI_MPXS_CONNS).
+        // When off, a second concurrent request gets FCGI_CANT_MPX_CONN.
+        bool multiplex = true;
+
+        // How the built-in calculator receives request bodies: "buffer"
+        // collects the whole body before it runs, "stream" hands it STDIN
+        // chunks as they arrive. Other handlers choose in OpenBodyStream.
+        std::string bodyMode = "buffer";
+
+        // Buffered bodies larger than this move to an unlinked file in tempDir.
+        unsigned int bodyMemoryLimit = 1024 * 1024;
+        std::string tempDir = "/tmp";
+
+        // Streamed body bytes a handler may fall behind by before the
+        // connection stops reading; reading resumes at half this.
+        unsigned int bodyStreamWindow = 1024 * 1024;
+
+        // When set, GET requests for regular files below this directory are
+        // answered straight from the file with sendfile(2).
+        std::string documentRoot;
+
+        // Requests for this path (DOCUMENT_URI or SCRIPT_NAME) are answered
+        // with the server's metrics in the Prometheus text format. Empty
+        // disables it.
+        std::string statsPath;
+
+        // Milliseconds a response to a GET or HEAD request without a body
+        // is kept and replayed to identical requests; 0 disables the cache.
+        // Requests are identical when the parameters named in cacheKeyParams
+        // (comma separated) match. cacheBytes bounds the cached responses.
+        unsigned int cacheTtl = 0;
+        std::string cacheKeyParams = "REQUEST_METHOD,HTTP_HOST,DOCUMENT_URI,SCRIPT_NAME,QUERY_STRING";
+        unsigned int cacheBytes = 64 * 1024 * 1024;
+
+        // Queued response bytes at which a connection writes out without
+        // waiting for the end of the request.
+        unsigned int outputHighWater = 256 * 1024;
+    };
+
+    // Fills `config` from --name=value arguments (names as in ServerConfig,
+    // e.g. --shards=8 --cpuAffinity=1). Returns false on an unknown option or
+    // malformed value, with a description in `error`.
+    bool ParseServerConfig(int argc, char** argv, ServerConfig& config, std::string& error);
+
+    // Largest record the protocol can describe: header, 16-bit content, 8-bit padding.
+    static const unsigned int max_record_len = FCGI_HEADER_LEN + ushort_max + 0xff;
+
+    // Fixed size-class pool backing RecordBuf. Each thread keeps its own bounded
+    // free lists, so allocating and releasing records on the hot path does not
+    // take a lock or go through malloc once the lists are warm.
+    class RecordPool
+    {
+    public:
+        enum SizeClass
+        {
+            SmallClass,
+            MediumClass,
+            LargeClass,
+            SizeClassCount
+        };
+
+        struct Stats
+        {
+            unsigned long long allocations[SizeClassCount];
+            unsigned long long poolHits[SizeClassCount];
+            unsigned long long releases[SizeClassCount];
+            unsigned long long heapAllocations;
+            unsigned long long heapFrees;
+            unsigned long long cachedBlocks;
+        };
+
+        static void* Allocate(unsigned int size);
+        static void Release(void* ptr);
+
+        // Sums the counters of every live thread and of threads that have exited.
+        static Stats GetStats();
+    };
+
     struct RecordBuf {
         SoraFCGIHeader header;
         char content[1];
 
+        // Content is not zeroed; callers are expected to fill every byte they send.
         static RecordBuf* Create(unsigned short reqId, unsigned char type, int contentLen)
         {
-            RecordBuf* result = (RecordBuf*)calloc(contentLen + FCGI_HEADER_LEN, 1);
+            RecordBuf* result = (RecordBuf*)RecordPool::Allocate(contentLen + FCGI_HEADER_LEN);
             result->header.version = FCGI_VERSION_1;
             result->header.RequestId(reqId);
             result->header.ContentLength(contentLen);
             result->header.type = type;
+            result->header.paddingLength = 0;
+            result->header.reserved = 0;
             return result;
         }
 
         static RecordBuf* Create(SoraFCGIHeader& header)
         {
-            RecordBuf* result = (RecordBuf*)calloc(header.BodyLength() + FCGI_HEADER_LEN, 1);
+            RecordBuf* result = (RecordBuf*)RecordPool::Allocate(header.BodyLength() + FCGI_HEADER_LEN);
             result->header = header;
             return result;
         }
@@ -76,13 +278,899 @@ namespace SoraFastCGI
     {
         void operator()(RecordBuf* val) const
         {
-            if (val) free(val);
+            if (val) RecordPool::Release(val);
         }
     };
 
     using RecordBufPtr = std::unique_ptr < RecordBuf, RecordBufDelete >;
 
+    // A complete record that still lives in the connection's receive buffer.
+    // The content pointer is only valid until the buffer is consumed or refilled.
+    struct RecordView
+    {
+        SoraFCGIHeader header;
+        const char* content;
+    };
+
+    // Contiguous receive area the socket reads straight into. Complete records
+    // are handed out as RecordViews without copying; only the tail of a partial
+    // record is ever moved, and only when the free space at the end runs out.
+    class ReceiveBuffer
+    {
+        char* data_;
+        unsigned int capacity_;
+        unsigned int begin_;
+        unsigned int end_;
+
+    public:
+        static const unsigned int default_capacity = 16 * 1024;
+
+        ReceiveBuffer()
+            : data_{}
+            , capacity_{}
+            , begin_{}
+            , end_{}
+        {
+        }
+
+        ~ReceiveBuffer()
+        {
+            free(data_);
+        }
+
+        ReceiveBuffer(const ReceiveBuffer&) = delete;
+        ReceiveBuffer& operator=(const ReceiveBuffer&) = delete;
+
+        const char* Data() const { return data_ + begin_; }
+        unsigned int Size() const { return end_ - begin_; }
+        unsigned int Capacity() const { return capacity_; }
+
+        char* WritePtr() { return data_ + end_; }
+        unsigned int WriteSpace() const { return capacity_ - end_; }
+
+        void Commit(unsigned int len) { end_ += len; }
+
+        void Consume(unsigned int len)
+        {
+            begin_ += len;
+            if (begin_ == end_)
+                begin_ = end_ = 0;
+        }
+
+        // Makes room for at least `needed` bytes of unconsumed data plus some
+        // free space to read into, compacting or growing as required.
+        void Reserve(unsigned int needed)
+        {
+            if (needed < default_capacity)
+                needed = default_capacity;
+
+            if (capacity_ >= needed && WriteSpace() > 0 && capacity_ - begin_ >= needed)
+                return;
+
+            unsigned int size = Size();
+            if (capacity_ >= needed)
+            {
+                memmove(data_, data_ + begin_, size);
+            }
+            else
+            {
+                char* newData = (char*)malloc(needed);
+                if (!newData)
+                    throw std::bad_alloc();
+                if (size)
+                    memcpy(newData, data_ + begin_, size);
+                free(data_);
+                data_ = newData;
+                capacity_ = needed;
+            }
+            begin_ = 0;
+            end_ = size;
+        }
+
+        // Frees the storage if it holds no data and is larger than `keep`
+        // bytes; the next Reserve allocates afresh.
+        void Release(unsigned int keep)
+        {
+            if (Size() == 0 && capacity_ > keep)
+            {
+                free(data_);
+                data_ = nullptr;
+                capacity_ = begin_ = end_ = 0;
+            }
+        }
+
+        // Returns the next complete record, or false if more data is needed.
+        // `needed` receives the number of bytes the pending record occupies.
+        bool PeekRecord(RecordView& record, unsigned int& needed) const
+        {
+            needed = FCGI_HEADER_LEN;
+            if (Size() < FCGI_HEADER_LEN)
+                return false;
+
+            memcpy(&record.header, Data(), FCGI_HEADER_LEN);
+            needed = record.header.TotalLength();
+            if (Size() < needed)
+                return false;
+
+            record.content = Data() + FCGI_HEADER_LEN;
+            return true;
+        }
+    };
+
     const char* ReadKeyValuePair(const char* beginPtr, std::string& key, std::string& value);
+
+    // Appends one name-value pair in FCGI_PARAMS / GET_VALUES encoding.
+    void AppendKeyValuePair(std::string& out, std::string_view name, std::string_view value);
+
+    // Request body collected for a handler. It stays in memory up to a limit
+    // and then moves to an unlinked temporary file, so a large upload costs
+    // disk space rather than resident memory.
+    class RequestBody
+    {
+        std::string memory_;
+        int fd_;
+        unsigned long long size_;
+        unsigned long long readPos_;
+
+    public:
+        RequestBody();
+        ~RequestBody();
+
+        RequestBody(const RequestBody&) = delete;
+        RequestBody& operator=(const RequestBody&) = delete;
+
+        // Appends body bytes, spilling to a file in `tempDir` once the body
+        // would exceed `memoryLimit`. Returns false if the file cannot be written.
+        bool Append(const char* data, std::size_t len, std::size_t memoryLimit, const std::string& tempDir);
+
+        // Reads sequentially from the start of the body; returns 0 at the end.
+        std::size_t Read(char* buf, std::size_t len);
+
+        unsigned long long Size() const { return size_; }
+        std::size_t MemoryBytes() const { return memory_.size(); }
+        bool Spilled() const { return fd_ >= 0; }
+
+        // Drops the content and any temporary file; keeps a modest amount of
+        // memory capacity for the next request.
+        void Clear();
+    };
+
+
+    // Decodes the two length prefixes of the name-value pair at `beginPtr`.
+    // Returns a pointer to the name bytes, or nullptr if [beginPtr, endPtr)
+    // does not hold the whole pair yet.
+    const char* ReadKeyValueLengths(const char* beginPtr, const char* endPtr, unsigned int& nameLen, unsigned int& valueLen);
+
+#define SORA_FCGI_KNOWN_PARAMS(X) \
+    X(GatewayInterface, "GATEWAY_INTERFACE") \
+    X(ServerSoftware, "SERVER_SOFTWARE") \
+    X(ServerName, "SERVER_NAME") \
+    X(ServerAddr, "SERVER_ADDR") \
+    X(ServerPort, "SERVER_PORT") \
+    X(ServerProtocol, "SERVER_PROTOCOL") \
+    X(RequestMethod, "REQUEST_METHOD") \
+    X(RequestUri, "REQUEST_URI") \
+    X(RequestScheme, "REQUEST_SCHEME") \
+    X(DocumentUri, "DOCUMENT_URI") \
+    X(DocumentRoot, "DOCUMENT_ROOT") \
+    X(ScriptName, "SCRIPT_NAME") \
+    X(ScriptFilename, "SCRIPT_FILENAME") \
+    X(PathInfo, "PATH_INFO") \
+    X(QueryString, "QUERY_STRING") \
+    X(ContentType, "CONTENT_TYPE") \
+    X(ContentLength, "CONTENT_LENGTH") \
+    X(RemoteAddr, "REMOTE_ADDR") \
+    X(RemotePort, "REMOTE_PORT") \
+    X(RemoteUser, "REMOTE_USER") \
+    X(Https, "HTTPS") \
+    X(RedirectStatus, "REDIRECT_STATUS") \
+    X(HttpHost, "HTTP_HOST") \
+    X(HttpCookie, "HTTP_COOKIE") \
+    X(HttpUserAgent, "HTTP_USER_AGENT") \
+    X(HttpAccept, "HTTP_ACCEPT") \
+    X(HttpAcceptEncoding, "HTTP_ACCEPT_ENCODING") \
+    X(HttpAcceptLanguage, "HTTP_ACCEPT_LANGUAGE") \
+    X(HttpConnection, "HTTP_CONNECTION") \
+    X(HttpReferer, "HTTP_REFERER")
+
+    enum KnownParam
+    {
+#define SORA_FCGI_PARAM_ENUM(id, name) Param##id,
+        SORA_FCGI_KNOWN_PARAMS(SORA_FCGI_PARAM_ENUM)
+#undef SORA_FCGI_PARAM_ENUM
+        KnownParamCount,
+        UnknownParam = KnownParamCount
+    };
+
+    // Maps a parameter name to its fixed slot through a table built once at
+    // startup; returns UnknownParam for anything else.
+    KnownParam LookupKnownParam(const char* name, unsigned int len);
+
+    // Parameters of one request. The raw FCGI_PARAMS stream is appended to an
+    // arena that is reused across requests and names/values are kept as
+    // offsets into it, so decoding allocates nothing once warm and pairs may
+    // span any number of PARAMS records. Well-known CGI variables are also
+    // indexed by KnownParam for constant-time lookup.
+    //
+    // A store is reused for the requests of one connection, and the front
+    // end sends the same names in the same order every time. Clear keeps the
+    // last request's names, and a name equal to the one at the same position
+    // last time takes its KnownParam from there instead of being looked up
+    // again. That lookup is all it saves: every pair is still decoded and
+    // copied into the arena, whether or not its value changed.
+    class ParamStore
+    {
+    public:
+        static const unsigned int max_params_bytes = 1024 * 1024;
+
+        struct Entry
+        {
+            unsigned int nameOffset;
+            unsigned int nameLen;
+            unsigned int valueOffset;
+            unsigned int valueLen;
+            KnownParam param;
+        };
+
+        ParamStore()
+            : decoded_{}
+        {
+            Clear();
+        }
+
+        void Clear()
+        {
+            // A second Clear in a row must not lose the pairs kept by the first.
+            if (!entries_.empty())
+            {
+                arena_.swap(previousArena_);
+                entries_.swap(previousEntries_);
+            }
+            arena_.clear();
+            entries_.clear();
+            decoded_ = 0;
+            for (auto& slot : known_)
+                slot = -1;
+        }
+
+        // Appends a chunk of the PARAMS stream and decodes every pair it
+        // completes. Returns false if the stream exceeds max_params_bytes.
+        bool Append(const char* data, unsigned int len);
+
+        // True when no partially received pair is pending.
+        bool Complete() const { return decoded_ == arena_.size(); }
+
+        unsigned int Size() const { return (unsigned int)entries_.size(); }
+
+        std::string_view Name(unsigned int i) const
+        {
+            return std::string_view(arena_.data() + entries_[i].nameOffset, entries_[i].nameLen);
+        }
+
+        std::string_view Value(unsigned int i) const
+        {
+            return std::string_view(arena_.data() + entries_[i].valueOffset, entries_[i].valueLen);
+        }
+
+        // Returns an empty view for parameters that were not sent.
+        std::string_view Get(KnownParam param) const
+        {
+            int i = param < KnownParamCount ? known_[param] : -1;
+            return i < 0 ? std::string_view() : Value(i);
+        }
+
+        std::string_view Get(std::string_view name) const;
+
+        bool Has(KnownParam param) const
+        {
+            return param < KnownParamCount && known_[param] >= 0;
+        }
+
+    private:
+        std::vector<char> arena_;
+        std::vector<Entry> entries_;
+        unsigned int decoded_;
+
+        // The previous request's pairs, kept by Clear to compare names with.
+        std::vector<char> previousArena_;
+        std::vector<Entry> previousEntries_;
+        int known_[KnownParamCount];
+    };
+
+    enum LogLevel
+    {
+        LogError,
+        LogWarning,
+        LogInfo,
+        LogDebug
+    };
+
+    // One log message. Arguments are stored in a compact binary form and only
+    // turned into text on the logger thread; the destructor hands the message
+    // to the calling thread's ring buffer without locking or allocating.
+    // Use it through the LogOutput macro.
+    class LogLine
+    {
+    public:
+        // Encoded size limit of one message; longer messages are cut short.
+        static const unsigned int max_size = 1024;
+
+        explicit LogLine(LogLevel level)
+            : size_{}
+        {
+            buf_[size_++] = (char)level;
+        }
+
+        ~LogLine();
+
+        LogLine(const LogLine&) = delete;
+        LogLine& operator=(const LogLine&) = delete;
+
+        LogLine& operator << (std::string_view s)
+        {
+            PutString(s.data(), s.size());
+            return *this;
+        }
+
+        LogLine& operator << (const char* s)
+        {
+            PutString(s, s ? strlen(s) : 0);
+            return *this;
+        }
+
+        LogLine& operator << (const std::string& s)
+        {
+            PutString(s.data(), s.size());
+            return *this;
+        }
+
+        LogLine& operator << (char c)
+        {
+            Put('c', &c, 1);
+            return *this;
+        }
+
+        LogLine& operator << (double v)
+        {
+            Put('d', &v, sizeof(v));
+            return *this;
+        }
+
+        template<class T>
+        typename std::enable_if<std::is_integral<T>::value, LogLine&>::type operator << (T v)
+        {
+            if (std::is_signed<T>::value)
+            {
+                long long x = v;
+                Put('i', &x, sizeof(x));
+            }
+            else
+            {
+                unsigned long long x = v;
+                Put('u', &x, sizeof(x));
+            }
+            return *this;
+        }
+
+    private:
+        unsigned int size_;
+        char buf_[max_size];
+
+        void Put(char tag, const void* data, unsigned int len)
+        {
+            if (size_ + 1 + len > max_size)
+                return;
+            buf_[size_] = tag;
+            memcpy(buf_ + size_ + 1, data, len);
+            size_ += 1 + len;
+        }
+
+        void PutString(const char* s, std::size_t len)
+        {
+            if (size_ + 3 > max_size)
+                return;
+            unsigned short curlen = (unsigned short)std::min<std::size_t>(len, max_size - size_ - 3);
+            buf_[size_] = 's';
+            memcpy(buf_ + size_ + 1, &curlen, sizeof(curlen));
+            memcpy(buf_ + size_ + 3, s, curlen);
+            size_ += 3 + curlen;
+        }
+    };
+
+    // Receives a request body chunk by chunk, in order, on the handler pool.
+    class IBodyConsumer
+    {
+    public:
+        virtual ~IBodyConsumer() {}
+        virtual void OnBodyData(const char* data, std::size_t len) = 0;
+        virtual void OnBodyEnd() = 0;
+    };
+
+    // Receives the fields of a form from FormParser, in order.
+    class IFormFieldConsumer
+    {
+    public:
+        virtual ~IFormFieldConsumer() {}
+
+        // `filename` is only set for file parts of a multipart form.
+        virtual void OnFieldBegin(std::string_view name, std::string_view filename) = 0;
+
+        // Decoded value bytes; a value may come in any number of pieces.
+        virtual void OnFieldData(const char* data, std::size_t len) = 0;
+
+        virtual void OnFieldEnd() = 0;
+    };
+
+    // Streaming parser for application/x-www-form-urlencoded and
+    // multipart/form-data bodies, fed chunks of any size as they arrive.
+    // Delimiters are found with SSE2 or AVX2 compares where the build
+    // targets them (scalar with SORA_FCGI_NO_SIMD or elsewhere). Urlencoded
+    // values are percent-decoded and passed on in runs; multipart part
+    // bodies are passed on as they are, without being held back beyond the
+    // bytes that might start a boundary.
+    class FormParser : public IBodyConsumer
+    {
+    public:
+        enum Encoding
+        {
+            UrlEncoded,
+            Multipart,
+            Unsupported
+        };
+
+        // Longest field name, and part header block, kept while parsing.
+        static const std::size_t max_name_len = 4096;
+        static const std::size_t max_part_header_len = 16 * 1024;
+
+        // `contentType` is the CONTENT_TYPE parameter; empty is taken as
+        // urlencoded, and multipart needs a boundary.
+        FormParser(std::string_view contentType, IFormFieldConsumer& fields);
+
+        Encoding GetEncoding() const { return encoding_; }
+
+        // Set once the body turned out malformed or over a limit, or its
+        // type is not a form; whatever follows is ignored.
+        bool Failed() const { return state_ == StateFailed; }
+
+        void OnBodyData(const char* data, std::size_t len) override;
+        void OnBodyEnd() override;
+
+    private:
+        enum State
+        {
+            StateName,
+            StateValue,
+            StatePreamble,
+            StateDelimiterEnd,
+            StatePartHeaders,
+            StatePartBody,
+            StateDone,
+            StateFailed
+        };
+
+        IFormFieldConsumer& fields_;
+        Encoding encoding_;
+        State state_;
+
+        // "\r\n--" followed by the multipart boundary.
+        std::string delimiter_;
+
+        // Urlencoded: the name being collected, decoded value bytes not yet
+        // passed on, and a percent escape cut off by the end of a chunk.
+        std::string name_;
+        std::string value_;
+        char escape_[3];
+        unsigned int escapeLen_;
+
+        // Multipart: bytes that may be the start of the delimiter, and the
+        // headers of the part being read.
+        std::string partial_;
+        std::string headers_;
+
+        void ParseUrlEncoded(const char* p, const char* end);
+        void DecodeEscape(std::string& out);
+        void EndUrlEncodedField();
+
+        void ParseMultipart(const char* p, const char* end);
+        const char* ScanPart(const char* p, const char* end);
+        bool BeginPart();
+        void PartData(const char* data, std::size_t len);
+    };
+
+    // Keeps the fields of a small form in memory, up to `maxBytes` of names
+    // and values in total; further fields are dropped and Truncated is set.
+    class FormFields : public IFormFieldConsumer
+    {
+    public:
+        explicit FormFields(std::size_t maxBytes = 64 * 1024);
+
+        void OnFieldBegin(std::string_view name, std::string_view filename) override;
+        void OnFieldData(const char* data, std::size_t len) override;
+        void OnFieldEnd() override;
+
+        // Value of the first field called `name`; empty if there is none.
+        std::string_view Get(std::string_view name) const;
+
+        unsigned int Size() const { return (unsigned int)fields_.size(); }
+        const std::string& Name(unsigned int i) const { return fields_[i].first; }
+        const std::string& Value(unsigned int i) const { return fields_[i].second; }
+        bool Truncated() const { return truncated_; }
+
+    private:
+        std::vector<std::pair<std::string, std::string>> fields_;
+        std::size_t maxBytes_;
+        std::size_t bytes_;
+        bool truncated_;
+        bool open_;
+    };
+
+    // What a handler sees of the request it serves.
+    class IRequest
+    {
+    public:
+        virtual ~IRequest() {}
+
+        virtual const ParamStore& Params() const = 0;
+
+        // DOCUMENT_URI, or SCRIPT_NAME when nginx sent no DOCUMENT_URI.
+        virtual std::string_view Path() const = 0;
+
+        // Reads a buffered body sequentially; returns 0 at the end.
+        virtual std::size_t ReadBody(char* buf, std::size_t len) = 0;
+        virtual unsigned long long BodySize() const = 0;
+
+        // The consumer the handler returned from OpenBodyStream, which has
+        // seen the whole body by the time Handle runs; null if buffered.
+        virtual IBodyConsumer* BodyConsumer() const = 0;
+
+        // Set once the request has been abandoned: the web server sent
+        // FCGI_ABORT_REQUEST, the connection went away or requestTimeout
+        // passed. Handlers doing long work should poll it and return; what
+        // they write from then on is dropped.
+        virtual bool Cancelled() const = 0;
+    };
+
+    // How a handler answers. Headers go out in front of the first body byte;
+    // STDOUT, STDERR and END_REQUEST are closed when Handle returns.
+    class IResponse
+    {
+    public:
+        virtual ~IResponse() {}
+
+        virtual void Header(std::string_view name, std::string_view value) = 0;
+
+        virtual void Write(std::string&& data) = 0;
+        virtual void Write(std::string_view data) = 0;
+
+        void Write(const char* data)
+        {
+            Write(std::string_view(data));
+        }
+
+        // Sends a file range without copying it; see Worker::SendFile.
+        virtual bool SendFile(int fd, unsigned long long offset, unsigned long long length) = 0;
+
+        // Text for the web server's error log (FCGI_STDERR).
+        virtual void Error(std::string_view text) = 0;
+
+        // Application status reported in FCGI_END_REQUEST.
+        virtual void Exit(unsigned int status) = 0;
+    };
+
+    // Classes of the handler run queue, most urgent first.
+    enum HandlerPriority
+    {
+        PriorityHigh,
+        PriorityNormal,
+        PriorityBulk,
+        PriorityCount
+    };
+
+    // Application code. Handle runs on the handler pool, one call per
+    // request, and may run concurrently for different requests.
+    class IHandler
+    {
+    public:
+        virtual ~IHandler() {}
+
+        // Run queue class for a request once its body is in; requests with
+        // large bodies are moved to PriorityBulk regardless. Streamed
+        // bodies run in arrival order on their stream and skip the queue.
+        virtual HandlerPriority Priority(const IRequest& request)
+        {
+            return PriorityNormal;
+        }
+
+        // Whether the response may go into the response cache, when that is
+        // enabled. Only asked for GET and HEAD requests without a body;
+        // responses other than 200, with Set-Cookie or with a Cache-Control
+        // of no-store, no-cache or private are never cached.
+        virtual bool Cacheable(const IRequest& request)
+        {
+            return true;
+        }
+
+        // Called once PARAMS are complete. Returning a consumer streams the
+        // body into it as it arrives; returning null buffers the body.
+        virtual std::unique_ptr<IBodyConsumer> OpenBodyStream(const IRequest& request)
+        {
+            return nullptr;
+        }
+
+        virtual void Handle(IRequest& request, IResponse& response) = 0;
+    };
+
+    // Maps request paths to handlers. Routes are collected with Add and
+    // compiled into a flat trie, so Find walks each path byte once and does
+    // not allocate. An exact route wins over a prefix route; among prefix
+    // routes the longest wins.
+    class Router
+    {
+    public:
+        enum MatchKind
+        {
+            MatchExact,
+            MatchPrefix
+        };
+
+        Router();
+        ~Router();
+
+        Router(const Router&) = delete;
+        Router& operator=(const Router&) = delete;
+
+        // The router does not own handlers. Adding after Compile recompiles
+        // on the next Compile call.
+        void Add(std::string_view path, MatchKind kind, IHandler* handler);
+        void Compile();
+
+        // Null when nothing matches.
+        IHandler* Find(std::string_view path) const;
+
+    private:
+        struct BuildNode;
+
+        struct Node
+        {
+            unsigned int firstEdge;
+            unsigned short edgeCount;
+            IHandler* exact;
+            IHandler* prefix;
+        };
+
+        struct Edge
+        {
+            unsigned char byte;
+            unsigned int child;
+        };
+
+        std::unique_ptr<BuildNode> root_;
+        std::vector<Node> nodes_;
+        std::vector<Edge> edges_;
+    };
+
+    // Complete responses of cacheable requests, kept for cacheTtl under a
+    // key made of the cacheKeyParams values. A response is stored as the
+    // records that answer request id 1, END_REQUEST included, so a hit goes
+    // out as one buffer in one write. Keys are spread over lock stripes,
+    // each evicting its least recently used responses past its share of
+    // cacheBytes. While one request computes a key, others asking for it
+    // wait for that response instead of running the handler as well.
+    class ResponseCache
+    {
+    public:
+        using Response = std::shared_ptr<const std::string>;
+
+        // Receives the response a request waited for, or null if it did not
+        // make it into the cache. Called on the thread that completed it.
+        using Waiter = std::function<void(const Response&)>;
+
+        enum LookupResult
+        {
+            Hit,
+            Miss,
+            Pending
+        };
+
+        explicit ResponseCache(const ServerConfig& config);
+        ~ResponseCache();
+
+        ResponseCache(const ResponseCache&) = delete;
+        ResponseCache& operator=(const ResponseCache&) = delete;
+
+        // Replaces `key` with the cache key of a request.
+        void MakeKey(const ParamStore& params, std::string& key) const;
+
+        // Hit fills `response`. Miss hands the key to the caller, which must
+        // call Complete for it exactly once. Pending means another request
+        // is computing it; Wait for its response.
+        LookupResult Lookup(const std::string& key, Response& response);
+
+        // Queues `waiter` on a pending key. If the key has been completed
+        // since Lookup, `waiter` runs right away with what is cached now.
+        void Wait(const std::string& key, Waiter waiter);
+
+        // Stores the response for a key the caller got a Miss for, or drops
+        // the key if `response` is null, and wakes the waiters.
+        void Complete(const std::string& key, Response response);
+
+        // Copy of `records` with every record's request id set to `reqId`.
+        static std::string Reframe(const std::string& records, unsigned short reqId);
+
+    private:
+        struct Stripe;
+
+        static const unsigned int stripe_count = 16;
+
+        std::vector<std::string> keyParams_;
+        unsigned long long ttlNs_;
+        std::size_t stripeBytes_;
+        std::unique_ptr<Stripe[]> stripes_;
+
+        Stripe& StripeOf(const std::string& key);
+    };
+
+    // Process-wide counters and latency histograms. Updates go to per-thread
+    // slots without locked instructions; Format merges every thread's slots
+    // when the stats are read.
+    class Metrics
+    {
+    public:
+        enum Counter
+        {
+            Accepts,
+            ConnectionsOpened,
+            ConnectionsClosed,
+            ConnectionsRejected,
+            ConnectionsTimedOut,
+            RequestsStarted,
+            RequestsFinished,
+            RequestsRejected,
+            RequestsCancelled,
+            RequestsShed,
+            CacheHits,
+            CacheMisses,
+            CacheCoalesced,
+            BytesIn,
+            BytesOut,
+            CounterCount
+        };
+
+        enum Histogram
+        {
+            ParamsDecode,
+            HandlerTime,
+            WriteStall,
+            RequestTime,
+            HandlerQueueWait,
+            HistogramCount
+        };
+
+        // Record types are counted by FastCGI type; anything past
+        // FCGI_MAXTYPE shares the last slot.
+        static const unsigned int record_type_slots = FCGI_MAXTYPE + 2;
+
+        static void Add(Counter counter, unsigned long long n = 1);
+        static void AddRecord(unsigned char type);
+
+        // Records one duration in nanoseconds.
+        static void Record(Histogram histogram, unsigned long long ns);
+
+        // Monotonic clock in nanoseconds.
+        static unsigned long long Now();
+
+        // Every counter and histogram in the Prometheus text format.
+        static std::string Format();
+    };
+
+    // A bare io_uring instance driven through the system calls. Queuing and
+    // Submit must be serialized by the caller; Reap is meant for one thread
+    // at a time and may run alongside them. Completions are announced on
+    // EventFd(). Receives draw from a group of buffers provided up front.
+    class UringQueue
+    {
+    public:
+        struct Completion
+        {
+            unsigned long long userData;
+            int result;
+            unsigned int flags;
+        };
+
+        UringQueue();
+        ~UringQueue();
+
+        UringQueue(const UringQueue&) = delete;
+        UringQueue& operator=(const UringQueue&) = delete;
+
+        bool Init(unsigned int entries, unsigned int bufferCount, unsigned int bufferSize, std::string& error);
+
+        int EventFd() const;
+
+        // Free submission slots; a linked chain must fit before it is queued.
+        unsigned int Space() const;
+
+        // Each queues one operation, to be started by Submit. They return
+        // false when the queue is full and cannot be flushed.
+        // Multishot: one completion per accepted socket, the result being its descriptor.
+        bool Accept(int fd, unsigned long long userData);
+        // Multishot: one completion per chunk, in the buffer named by BufferId.
+        bool Recv(int fd, unsigned long long userData);
+        // Sends all of `msg`. With `link` the next queued operation waits for
+        // this one, and is cancelled if this one comes up short.
+        bool SendMsg(int fd, const msghdr* msg, bool link, unsigned long long userData);
+        // Cancels the operation queued with `target`; completes with userData 0.
+        bool Cancel(unsigned long long target);
+
+        // Hands queued operations to the kernel; returns false on failure.
+        bool Submit();
+
+        // Takes up to `max` completions; 0 once the queue is drained.
+        unsigned int Reap(Completion* out, unsigned int max);
+
+        // Whether completions are waiting to be reaped.
+        bool Ready() const;
+
+        // Whether a multishot operation stays armed after this completion.
+        static bool HasMore(unsigned int flags);
+        // Provided buffer holding a receive's data, or -1.
+        static int BufferId(unsigned int flags);
+
+        const char* Buffer(int id) const;
+        // Gives a buffer back to the kernel once its data has been copied out;
+        // it goes with the next Submit.
+        void RecycleBuffer(int id);
+
+    private:
+        struct Ring;
+        std::unique_ptr<Ring> ring_;
+    };
+
+    struct LogStats
+    {
+        unsigned long long written;
+        unsigned long long dropped;
+    };
+
+    // Starts the thread that drains every thread's ring to stderr. Messages
+    // logged before this wait in the rings; once a ring is full, further
+    // messages are counted as dropped and reported instead of queued.
+    void StartLogger();
+
+    // Writes out everything still queued and stops the logger thread.
+    void StopLogger();
+
+    LogStats GetLogStats();
+
+    // Routes for the handlers that ship with the server: the metrics page at
+    // config.statsPath, static files below config.documentRoot and the
+    // calculator for everything else. The handlers live as long as the process.
+    void AddBuiltinRoutes(Router& router, const ServerConfig& config);
+
+    // Runs config.workers copies of the program `argv`, each serving the
+    // listening socket `listenFd` as its FCGI_LISTENSOCK_FILENO, until
+    // SIGTERM or SIGINT. Returns the exit code for the supervisor.
+    int RunSupervisor(const ServerConfig& config, int listenFd, char** argv);
+
+    // Takes the descriptor through which the supervisor that started this
+    // process waits to hear it is up, and removes it from the environment;
+    // -1 without a supervisor. Changes the environment, so it must run
+    // before the process starts any threads that might read it.
+    int TakeSupervisorFd();
+
+    // Tells the supervisor on `fd`, from TakeSupervisorFd, that the process
+    // accepts connections now. Does nothing for -1.
+    void NotifySupervisor(int fd);
 };
 
+// Messages above this level are compiled out together with their arguments.
+#ifndef SORA_FCGI_LOG_LEVEL
+#define SORA_FCGI_LOG_LEVEL 2
+#endif
+
+// Written as a loop so it stays a single statement inside an unbraced if.
+#define LogOutput(level) \
+    for (bool soraLogOnce = ::SoraFastCGI::level <= SORA_FCGI_LOG_LEVEL; soraLogOnce; soraLogOnce = false) \
+        ::SoraFastCGI::LogLine(::SoraFastCGI::level)
+
 #endif